@@ -6,18 +6,44 @@ Name: Poorvi Burly Prakash
 */
 
 #include <string.h>
+//NO_GL builds the renderer without any GL/GLUT dependency, headless only
+#ifndef NO_GL
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
 #include <GLUT/glut.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glut.h>
+#endif
+#endif
 #include "pic.h"
+#include "bscene.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <float.h>
+#include <limits.h>
 #include <vector>
-
-#define MAX_TRIANGLES 2000
-#define MAX_SPHERES 10
-#define MAX_LIGHTS 10
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 char *filename=0;
 
@@ -26,18 +52,38 @@ char *filename=0;
 #define MODE_JPEG 2
 int mode=MODE_DISPLAY;
 
-//you may want to make these smaller for debugging purposes
-#define WIDTH 640
-#define HEIGHT 480
+//--headless renders straight to the jpeg without opening a window
+#ifdef NO_GL
+bool headless=true;
+#else
+bool headless=false;
+#endif
+
+//render and BVH build threads, set with --threads, 0 uses every core
+int num_threads=0;
 
-//the field of view of the camera
-#define fov 60.0
+//image size, set with --width/--height
+int width=640;
+int height=480;
 
-unsigned char buffer[HEIGHT][WIDTH][3];
-float aspectRatio = (float) WIDTH/HEIGHT;
+//the field of view of the camera in degrees, set with --fov
+double fov=60.0;
+
+//rgb frame buffer, width*height*3 bytes with the top row first
+std::vector<unsigned char> buffer;
+float aspectRatio;
 double origin[3]= {0.0,0.0,0.0};
 
-double reflection[3];
+//camera basis, primary rays are built per pixel from these
+double camRight[3] = {1.0,0.0,0.0};
+double camUp[3] = {0.0,1.0,0.0};
+double camForward[3] = {0.0,0.0,-1.0};
+
+//camera orientation in degrees, set with --yaw/--pitch or in the window.
+//Positive yaw turns left around +y, positive pitch looks up, 0/0 looks
+//down -z. The eye is origin (--eye).
+double camYaw=0.0;
+double camPitch=0.0;
 
 struct Vertex
 {
@@ -48,12 +94,10 @@ struct Vertex
   double shininess;
 };
 
-Vertex vtl,vtr,vbl,vbr;
-Vertex p1,p2,p3,p4;
-Vertex vertices[HEIGHT][WIDTH];
-float areas[3];
-float totalArea=0.0;
-double finalColor[3]={0.0,0.0,0.0};
+//image plane corners at z=-1
+double vtl[3],vtr[3],vbl[3],vbr[3];
+//image plane position of pixel (0,0) and the step between pixels
+double planeLeft,planeBottom,planeStepX,planeStepY;
 
 typedef struct _Triangle
 {
@@ -75,18 +119,149 @@ typedef struct _Light
   double color[3];
 } Light;
 
-Triangle triangles[MAX_TRIANGLES];
-Sphere spheres[MAX_SPHERES];
-Light lights[MAX_LIGHTS];
+//scene storage grows with the scene file
+std::vector<Triangle> triangles;
+std::vector<Sphere> spheres;
+std::vector<Light> lights;
 double ambient_light[3];
 
 int num_triangles=0;
 int num_spheres=0;
 int num_lights=0;
 
-void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b);
 void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b);
 void plot_pixel(int x,int y,unsigned char r,unsigned char g,unsigned char b);
+void plot_block(int x,int y,int block,const double color[3]);
+
+//STATS
+//Ray counters are kept per thread and added to totalStats after every tile,
+//phase timers wrap the load, build, render and save steps. --stats prints
+//them, --stats-json writes them to a file.
+struct RayStats
+{
+  long primaryRays;
+  long shadowRays;
+  long triangleTests;
+  long sphereTests;
+  long nodesVisited;
+  long shadingCalls;
+};
+
+thread_local RayStats threadStats;
+RayStats totalStats;
+std::mutex statsLock;
+
+#define PHASE_LOAD 0
+#define PHASE_BUILD 1
+#define PHASE_RENDER 2
+#define PHASE_SAVE 3
+#define NUM_PHASES 4
+const char *phaseNames[NUM_PHASES] = {"load","build","render","save"};
+double phaseMs[NUM_PHASES];
+int phaseCalls[NUM_PHASES];
+
+//adds this thread's counters to the totals and starts it over
+void flushStats()
+{
+  std::lock_guard<std::mutex> guard(statsLock);
+  totalStats.primaryRays += threadStats.primaryRays;
+  totalStats.shadowRays += threadStats.shadowRays;
+  totalStats.triangleTests += threadStats.triangleTests;
+  totalStats.sphereTests += threadStats.sphereTests;
+  totalStats.nodesVisited += threadStats.nodesVisited;
+  totalStats.shadingCalls += threadStats.shadingCalls;
+  memset(&threadStats,0,sizeof(threadStats));
+}
+
+RayStats snapshotStats()
+{
+  std::lock_guard<std::mutex> guard(statsLock);
+  return totalStats;
+}
+
+void resetStats()
+{
+  std::lock_guard<std::mutex> guard(statsLock);
+  memset(&totalStats,0,sizeof(totalStats));
+  memset(phaseMs,0,sizeof(phaseMs));
+  memset(phaseCalls,0,sizeof(phaseCalls));
+}
+
+//times the enclosing scope into one of the phases
+struct ScopedTimer
+{
+  int phase;
+  std::chrono::steady_clock::time_point start;
+  ScopedTimer(int p) : phase(p), start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer()
+  {
+    double ms = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+    std::lock_guard<std::mutex> guard(statsLock);
+    phaseMs[phase] += ms;
+    phaseCalls[phase]++;
+  }
+};
+
+//counts one BVH traversal in registers and adds it to the thread's
+//counters on the way out, whichever return is taken
+struct TraversalCount
+{
+  long nodes, triangles, spheres;
+  TraversalCount() : nodes(0), triangles(0), spheres(0) {}
+  ~TraversalCount()
+  {
+    threadStats.nodesVisited += nodes;
+    threadStats.triangleTests += triangles;
+    threadStats.sphereTests += spheres;
+  }
+};
+
+//set with --stats and --stats-json
+bool show_stats=false;
+char *stats_json=NULL;
+
+void printStats(FILE *out)
+{
+  std::lock_guard<std::mutex> guard(statsLock);
+  fprintf(out,"primary rays    %12ld\n",totalStats.primaryRays);
+  fprintf(out,"shadow rays     %12ld\n",totalStats.shadowRays);
+  fprintf(out,"triangle tests  %12ld\n",totalStats.triangleTests);
+  fprintf(out,"sphere tests    %12ld\n",totalStats.sphereTests);
+  fprintf(out,"nodes visited   %12ld\n",totalStats.nodesVisited);
+  fprintf(out,"shading calls   %12ld\n",totalStats.shadingCalls);
+  for(int i=0;i<NUM_PHASES;i++)
+    fprintf(out,"%-8s %6d x %12.3f ms\n",phaseNames[i],phaseCalls[i],phaseMs[i]);
+}
+
+void writeStatsJson(FILE *out)
+{
+  std::lock_guard<std::mutex> guard(statsLock);
+  fprintf(out,"{\n  \"primary_rays\": %ld,\n  \"shadow_rays\": %ld,\n",totalStats.primaryRays,totalStats.shadowRays);
+  fprintf(out,"  \"triangle_tests\": %ld,\n  \"sphere_tests\": %ld,\n",totalStats.triangleTests,totalStats.sphereTests);
+  fprintf(out,"  \"nodes_visited\": %ld,\n  \"shading_calls\": %ld,\n",totalStats.nodesVisited,totalStats.shadingCalls);
+  fprintf(out,"  \"phases\": {");
+  for(int i=0;i<NUM_PHASES;i++)
+    fprintf(out,"%s\n    \"%s\": {\"calls\": %d, \"ms\": %.3f}",i ? "," : "",phaseNames[i],phaseCalls[i],phaseMs[i]);
+  fprintf(out,"\n  }\n}\n");
+}
+
+//prints and writes whatever --stats/--stats-json asked for
+void reportStats()
+{
+  if(show_stats)
+    printStats(stdout);
+  if(stats_json)
+  {
+    FILE *out = fopen(stats_json,"w");
+    if(!out)
+    {
+      printf("Could not write %s\n",stats_json);
+      return;
+    }
+    writeStatsJson(out);
+    fclose(out);
+  }
+}
 
 //MATRIX OPERATIONS
 void normalize(double *v){
@@ -96,7 +271,7 @@ void normalize(double *v){
   v[2] = v[2]/mag;
 } 
 
-float dotProduct(double v1[3],double v2[3]){
+float dotProduct(const double v1[3],const double v2[3]){
   return ((v1[0]*v2[0])+(v1[1]*v2[1])+(v1[2]*v2[2]));
 } 
 
@@ -107,119 +282,238 @@ void crossProduct(double v1[3],double v2[3], double *res)
     res[2] = v1[0] * v2[1] - v1[1] * v2[0];
 }
 
-void getSphereNormal(double *normal,double p[3], float t,int idx)
+void getSphereNormal(double *normal,const double p[3],int idx)
 {
-    normal[0] = (p[0]*t) - spheres[idx].position[0];
-    normal[1] = (p[1]*t) - spheres[idx].position[1];
-    normal[2] = (p[2]*t) - spheres[idx].position[2];
-    normalize(normal);
+    double invRadius = 1.0/spheres[idx].radius;
+    normal[0] = (p[0] - spheres[idx].position[0])*invRadius;
+    normal[1] = (p[1] - spheres[idx].position[1])*invRadius;
+    normal[2] = (p[2] - spheres[idx].position[2])*invRadius;
     
 }
 
+//forward and right vectors of a camera turned by yaw and pitch degrees
+void cameraAxes(double yaw, double pitch, double forward[3], double right[3])
+{
+  double changeToRadians = 0.0174532925;
+  yaw *= changeToRadians;
+  pitch *= changeToRadians;
+  forward[0] = -sin(yaw)*cos(pitch);
+  forward[1] = sin(pitch);
+  forward[2] = -cos(yaw)*cos(pitch);
+  right[0] = cos(yaw);
+  right[1] = 0.0;
+  right[2] = -sin(yaw);
+}
+
+void setCameraBasis()
+{
+  cameraAxes(camYaw,camPitch,camForward,camRight);
+  crossProduct(camRight,camForward,camUp);
+}
+
 void getImageBorders(){
   double changeToRadians = 0.0174532925;
+  aspectRatio = (float) width/height;
   //top-left : x = - a tan(fov/2), y = tan(fov/2), z=-1
-  vtl.position[0] = (-aspectRatio)*tan(changeToRadians*fov/2);
-  vtl.position[1] = tan(changeToRadians*fov/2);
-  vtl.position[2] = -1.0;
+  vtl[0] = (-aspectRatio)*tan(changeToRadians*fov/2);
+  vtl[1] = tan(changeToRadians*fov/2);
+  vtl[2] = -1.0;
   
   //bottom-left : x = - a tan(fov/2), y =  - tan(fov/2), z=-1
-  vbl.position[0] = (-aspectRatio)*tan(changeToRadians*fov/2);
-  vbl.position[1] = -tan(changeToRadians*fov/2);
-  vbl.position[2] = -1.0;
+  vbl[0] = (-aspectRatio)*tan(changeToRadians*fov/2);
+  vbl[1] = -tan(changeToRadians*fov/2);
+  vbl[2] = -1.0;
 
   //top-right : x = a tan(fov/2), y = tan(fov/2), z=-1
-  vtr.position[0] = (aspectRatio)*tan(changeToRadians*fov/2);
-  vtr.position[1] = tan(changeToRadians*fov/2);
-  vtr.position[2] = -1.0;
+  vtr[0] = (aspectRatio)*tan(changeToRadians*fov/2);
+  vtr[1] = tan(changeToRadians*fov/2);
+  vtr[2] = -1.0;
 
   //bottom-right : x = a tan(fov/2), y =  - tan(fov/2), z=-1
-  vbr.position[0] = (aspectRatio)*tan(changeToRadians*fov/2);
-  vbr.position[1] = -tan(changeToRadians*fov/2);
-  vbr.position[2] = -1.0;
+  vbr[0] = (aspectRatio)*tan(changeToRadians*fov/2);
+  vbr[1] = -tan(changeToRadians*fov/2);
+  vbr[2] = -1.0;
 
-  //Setting values of every vertex on the image plane using subdivision
-  for(int i=0;i<HEIGHT;i++)
-    {
-        vertices[i][0].position[0]=vtl.position[0];
-        for(int j=0;j<WIDTH;j++)
-        {
-            vertices[i][j].position[2]=-1.0;
-            if(j==0)
-                vertices[i][j].position[0]=vbl.position[0];
-            else
-                vertices[i][j].position[0]=vertices[i][j-1].position[0]+((vtr.position[0]-vtl.position[0])/(WIDTH-1));
-            if(i==0)
-                vertices[i][j].position[1]=vbl.position[1];
-            else
-                vertices[i][j].position[1]=vertices[i-1][j].position[1]+((vtl.position[1]-vbl.position[1])/(HEIGHT-1));
-        }
-    }
+  //pixels are spread evenly between the borders, bottom row first
+  planeLeft = vbl[0];
+  planeBottom = vbl[1];
+  planeStepX = (vtr[0]-vtl[0])/(width>1 ? width-1 : 1);
+  planeStepY = (vtl[1]-vbl[1])/(height>1 ? height-1 : 1);
+}
+
+//Primary ray direction through pixel (i,j), not normalized
+void getPixelDirection(int i, int j, double *direction)
+{
+    double x = planeLeft + j*planeStepX;
+    double y = planeBottom + i*planeStepY;
+    direction[0] = camForward[0] + x*camRight[0] + y*camUp[0];
+    direction[1] = camForward[1] + x*camRight[1] + y*camUp[1];
+    direction[2] = camForward[2] + x*camRight[2] + y*camUp[2];
 }
 
-float raySphereIntersection(double org[3], double direction[3], Sphere s)
+//SIMD
+//Eight float lanes on AVX2, two SSE registers otherwise, and plain arrays
+//where neither exists. Comparisons return lane masks for vselect/vmask,
+//vloadbytes widens 8 unsigned bytes to floats.
+#if defined(__AVX2__)
+#define SIMD_NAME "AVX2"
+typedef __m256 vfloat8;
+inline vfloat8 vset1(float a) { return _mm256_set1_ps(a); }
+inline vfloat8 vload(const float *p) { return _mm256_loadu_ps(p); }
+inline void vstore(float *p, vfloat8 a) { _mm256_storeu_ps(p,a); }
+inline vfloat8 vadd(vfloat8 a, vfloat8 b) { return _mm256_add_ps(a,b); }
+inline vfloat8 vsub(vfloat8 a, vfloat8 b) { return _mm256_sub_ps(a,b); }
+inline vfloat8 vmul(vfloat8 a, vfloat8 b) { return _mm256_mul_ps(a,b); }
+inline vfloat8 vdiv(vfloat8 a, vfloat8 b) { return _mm256_div_ps(a,b); }
+inline vfloat8 vmin(vfloat8 a, vfloat8 b) { return _mm256_min_ps(a,b); }
+inline vfloat8 vmax(vfloat8 a, vfloat8 b) { return _mm256_max_ps(a,b); }
+inline vfloat8 vsqrt(vfloat8 a) { return _mm256_sqrt_ps(a); }
+inline vfloat8 vlt(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a,b,_CMP_LT_OQ); }
+inline vfloat8 vle(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a,b,_CMP_LE_OQ); }
+inline vfloat8 vand(vfloat8 a, vfloat8 b) { return _mm256_and_ps(a,b); }
+inline vfloat8 vor(vfloat8 a, vfloat8 b) { return _mm256_or_ps(a,b); }
+inline vfloat8 vselect(vfloat8 mask, vfloat8 a, vfloat8 b) { return _mm256_blendv_ps(b,a,mask); }
+inline int vmask(vfloat8 a) { return _mm256_movemask_ps(a); }
+inline vfloat8 vloadbytes(const unsigned char *p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p))); }
+#elif defined(__SSE2__)
+#define SIMD_NAME "SSE2"
+struct vfloat8 { __m128 lo, hi; };
+inline vfloat8 vmake(__m128 lo, __m128 hi) { vfloat8 r = {lo,hi}; return r; }
+inline vfloat8 vset1(float a) { return vmake(_mm_set1_ps(a),_mm_set1_ps(a)); }
+inline vfloat8 vload(const float *p) { return vmake(_mm_loadu_ps(p),_mm_loadu_ps(p+4)); }
+inline void vstore(float *p, vfloat8 a) { _mm_storeu_ps(p,a.lo); _mm_storeu_ps(p+4,a.hi); }
+inline vfloat8 vadd(vfloat8 a, vfloat8 b) { return vmake(_mm_add_ps(a.lo,b.lo),_mm_add_ps(a.hi,b.hi)); }
+inline vfloat8 vsub(vfloat8 a, vfloat8 b) { return vmake(_mm_sub_ps(a.lo,b.lo),_mm_sub_ps(a.hi,b.hi)); }
+inline vfloat8 vmul(vfloat8 a, vfloat8 b) { return vmake(_mm_mul_ps(a.lo,b.lo),_mm_mul_ps(a.hi,b.hi)); }
+inline vfloat8 vdiv(vfloat8 a, vfloat8 b) { return vmake(_mm_div_ps(a.lo,b.lo),_mm_div_ps(a.hi,b.hi)); }
+inline vfloat8 vmin(vfloat8 a, vfloat8 b) { return vmake(_mm_min_ps(a.lo,b.lo),_mm_min_ps(a.hi,b.hi)); }
+inline vfloat8 vmax(vfloat8 a, vfloat8 b) { return vmake(_mm_max_ps(a.lo,b.lo),_mm_max_ps(a.hi,b.hi)); }
+inline vfloat8 vsqrt(vfloat8 a) { return vmake(_mm_sqrt_ps(a.lo),_mm_sqrt_ps(a.hi)); }
+inline vfloat8 vlt(vfloat8 a, vfloat8 b) { return vmake(_mm_cmplt_ps(a.lo,b.lo),_mm_cmplt_ps(a.hi,b.hi)); }
+inline vfloat8 vle(vfloat8 a, vfloat8 b) { return vmake(_mm_cmple_ps(a.lo,b.lo),_mm_cmple_ps(a.hi,b.hi)); }
+inline vfloat8 vand(vfloat8 a, vfloat8 b) { return vmake(_mm_and_ps(a.lo,b.lo),_mm_and_ps(a.hi,b.hi)); }
+inline vfloat8 vor(vfloat8 a, vfloat8 b) { return vmake(_mm_or_ps(a.lo,b.lo),_mm_or_ps(a.hi,b.hi)); }
+inline vfloat8 vselect(vfloat8 mask, vfloat8 a, vfloat8 b)
+{
+  return vmake(_mm_or_ps(_mm_and_ps(mask.lo,a.lo),_mm_andnot_ps(mask.lo,b.lo)),
+               _mm_or_ps(_mm_and_ps(mask.hi,a.hi),_mm_andnot_ps(mask.hi,b.hi)));
+}
+inline int vmask(vfloat8 a) { return _mm_movemask_ps(a.lo) | (_mm_movemask_ps(a.hi)<<4); }
+inline vfloat8 vloadbytes(const unsigned char *p)
 {
+  __m128i zero = _mm_setzero_si128();
+  __m128i words = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),zero);
+  return vmake(_mm_cvtepi32_ps(_mm_unpacklo_epi16(words,zero)),_mm_cvtepi32_ps(_mm_unpackhi_epi16(words,zero)));
+}
+#else
+#define SIMD_NAME "scalar"
+struct vfloat8 { float f[8]; };
+inline float laneMask(bool b) { unsigned int bits = b ? 0xffffffffu : 0; float f; memcpy(&f,&bits,4); return f; }
+inline bool laneSet(float f) { unsigned int bits; memcpy(&bits,&f,4); return bits>>31; }
+#define VLANES(expr) vfloat8 r; for(int k=0;k<8;k++) r.f[k] = (expr); return r;
+inline vfloat8 vset1(float a) { VLANES(a) }
+inline vfloat8 vload(const float *p) { VLANES(p[k]) }
+inline void vstore(float *p, vfloat8 a) { memcpy(p,a.f,sizeof(a.f)); }
+inline vfloat8 vadd(vfloat8 a, vfloat8 b) { VLANES(a.f[k]+b.f[k]) }
+inline vfloat8 vsub(vfloat8 a, vfloat8 b) { VLANES(a.f[k]-b.f[k]) }
+inline vfloat8 vmul(vfloat8 a, vfloat8 b) { VLANES(a.f[k]*b.f[k]) }
+inline vfloat8 vdiv(vfloat8 a, vfloat8 b) { VLANES(a.f[k]/b.f[k]) }
+inline vfloat8 vmin(vfloat8 a, vfloat8 b) { VLANES(a.f[k] < b.f[k] ? a.f[k] : b.f[k]) }
+inline vfloat8 vmax(vfloat8 a, vfloat8 b) { VLANES(a.f[k] > b.f[k] ? a.f[k] : b.f[k]) }
+inline vfloat8 vsqrt(vfloat8 a) { VLANES(sqrtf(a.f[k])) }
+inline vfloat8 vlt(vfloat8 a, vfloat8 b) { VLANES(laneMask(a.f[k] < b.f[k])) }
+inline vfloat8 vle(vfloat8 a, vfloat8 b) { VLANES(laneMask(a.f[k] <= b.f[k])) }
+inline vfloat8 vand(vfloat8 a, vfloat8 b) { VLANES(laneMask(laneSet(a.f[k]) && laneSet(b.f[k]))) }
+inline vfloat8 vor(vfloat8 a, vfloat8 b) { VLANES(laneMask(laneSet(a.f[k]) || laneSet(b.f[k]))) }
+inline vfloat8 vselect(vfloat8 mask, vfloat8 a, vfloat8 b) { VLANES(laneSet(mask.f[k]) ? a.f[k] : b.f[k]) }
+inline int vmask(vfloat8 a) { int m = 0; for(int k=0;k<8;k++) m |= laneSet(a.f[k])<<k; return m; }
+inline vfloat8 vloadbytes(const unsigned char *p) { VLANES((float)p[k]) }
+#undef VLANES
+#endif
 
-    double o[3] = {org[0]-s.position[0],org[1]-s.position[1],org[2]-s.position[2]};
-    
-    float a = dotProduct(direction, direction);
-    float b = 2 * dotProduct(direction, o);
-    float c = dotProduct(o, o) - (s.radius * s.radius);
-    
-    float determinant = b * b - 4 * a * c;
-    float distSqrt = sqrtf(determinant);
+//TRIANGLE INTERSECTION RECORDS
+//The ray-triangle test only needs v0 and the two edges, so those are kept
+//apart from the fat Triangle structs as 9 float arrays (TRI_V0, TRI_EDGE1,
+//TRI_EDGE2 per axis) of triRecordStride entries each, 64-byte aligned.
+//Triangles are stored in BVH leaf order, so a leaf reads neighbouring
+//entries, and shading data is only fetched for the closest hit.
+#define TRI_V0 0
+#define TRI_EDGE1 3
+#define TRI_EDGE2 6
+#define TRI_RECORD_ARRAYS 9
 
-    if(determinant < 0.0) //Solution Exists only if sqrt(D) is Real (not Imaginary)
-      return 0; 
+float *triRecords=NULL;
+size_t triRecordStride=0;
 
-    float sign = (c < -0.00001) ? 1 : -1;    //Ray Originates Inside Sphere If C < 0
-    float t0 = (-b + sign*sqrtf(determinant))/(2*a); //Solve Quadratic Equation for Distance to Intersection
-    float t1 = c / ((-b + sign*sqrtf(determinant))/2.0);
-    if (t0 > t1)
+//Zeroed block of arrays float arrays with count entries each. Every array
+//is 64-byte aligned and there is room to load 8 lanes past the last entry.
+float *allocRecords(int arrays, int count, size_t *stride)
+{
+    *stride = (count+15)/16*16;
+    size_t bytes = arrays*(*stride)*sizeof(float)+64;
+    void *data = NULL;
+    if(posix_memalign(&data, 64, bytes) != 0)
     {
-        float temp = t0;
-        t0 = t1;
-        t1 = temp;
+        printf("Out of memory for %d records\n",count);
+        exit(1);
     }
-    if (t1 < 0)
-        return 0;
-    return (t0 < 0)? t1 : t0;
+    memset(data,0,bytes);
+    return (float *)data;
 }
 
-float rayTriangleIntersection(double org[3],double direction[3], Triangle *triangle)
+void buildTriangleRecords()
 {
-  double edge1[3]={triangle->v[1].position[0]-triangle->v[0].position[0],triangle->v[1].position[1]-triangle->v[0].position[1],triangle->v[1].position[2]-triangle->v[0].position[2]};
-    double edge2[3]={triangle->v[2].position[0]-triangle->v[0].position[0],triangle->v[2].position[1]-triangle->v[0].position[1],triangle->v[2].position[2]-triangle->v[0].position[2]};
-    
-    double prod[3];
-    crossProduct(edge1,edge2,prod);
-    
-    
-    double p[3];
-    crossProduct(direction,edge2,p);
+    free(triRecords);
+    triRecords = allocRecords(TRI_RECORD_ARRAYS, num_triangles, &triRecordStride);
+    for(int i=0;i<num_triangles;i++)
+        for(int a=0;a<3;a++)
+        {
+            const double *v0 = triangles[i].v[0].position;
+            triRecords[(TRI_V0+a)*triRecordStride+i] = v0[a];
+            triRecords[(TRI_EDGE1+a)*triRecordStride+i] = triangles[i].v[1].position[a]-v0[a];
+            triRecords[(TRI_EDGE2+a)*triRecordStride+i] = triangles[i].v[2].position[a]-v0[a];
+        }
+}
+
+inline float triRecord(int component, int idx)
+{
+    return triRecords[component*triRecordStride+idx];
+}
+
+//returns t (0 for a miss) and the barycentric coordinates of the hit in
+//*u (weight of v1) and *v (weight of v2)
+float rayTriangleIntersection(const float org[3],const float direction[3], int idx, float *u, float *v)
+{
+    float edge1[3]={triRecord(TRI_EDGE1,idx),triRecord(TRI_EDGE1+1,idx),triRecord(TRI_EDGE1+2,idx)};
+    float edge2[3]={triRecord(TRI_EDGE2,idx),triRecord(TRI_EDGE2+1,idx),triRecord(TRI_EDGE2+2,idx)};
     
-    normalize(prod);
+    //p = direction x edge2
+    float p[3]={direction[1]*edge2[2]-direction[2]*edge2[1],
+                direction[2]*edge2[0]-direction[0]*edge2[2],
+                direction[0]*edge2[1]-direction[1]*edge2[0]};
     
     const float EPSILON = 0.0000001;
-    float a = dotProduct(edge1, p);
+    float a = edge1[0]*p[0]+edge1[1]*p[1]+edge1[2]*p[2];
     if (a > -EPSILON && a < EPSILON)
         return false;    // This ray is parallel to this triangle.
 
     float f =  1 / a;
-    double s[3] ={org[0]-triangle->v[0].position[0],org[1]-triangle->v[0].position[1],org[2]-triangle->v[0].position[2]};
-    float u = f*(dotProduct(s, p));
-    if(u < 0.0 || u > 1.0)
+    float s[3] ={org[0]-triRecord(TRI_V0,idx),org[1]-triRecord(TRI_V0+1,idx),org[2]-triRecord(TRI_V0+2,idx)};
+    *u = f*(s[0]*p[0]+s[1]*p[1]+s[2]*p[2]);
+    if(*u < 0.0 || *u > 1.0)
         return 0;
     
-    double q[3];
-    crossProduct(s, edge1, q);
-    float v = f * (dotProduct(direction, q));
-    if(v < 0.0 || u + v > 1.0)
+    //q = s x edge1
+    float q[3]={s[1]*edge1[2]-s[2]*edge1[1],
+                s[2]*edge1[0]-s[0]*edge1[2],
+                s[0]*edge1[1]-s[1]*edge1[0]};
+    *v = f * (direction[0]*q[0]+direction[1]*q[1]+direction[2]*q[2]);
+    if(*v < 0.0 || *u + *v > 1.0)
         return 0;
     
     // at this stage we can compute t to find out where
 	// the intersection point is on the line
-	float t0 = f * dotProduct(edge2,q);
+	float t0 = f * (edge2[0]*q[0]+edge2[1]*q[1]+edge2[2]*q[2]);
     
 	if (t0 > EPSILON) // ray intersection
 		return t0;
@@ -229,512 +523,3675 @@ float rayTriangleIntersection(double org[3],double direction[3], Triangle *trian
         return 0;   
 }
 
-void sphereShadowRays(Vertex *direction, double *l, float t, int idx){
-  double v[3] = {direction->position[0]*t,direction->position[1]*t,direction->position[2]*t};
-    bool flag=false;
+//SPHERE INTERSECTION RECORDS
+//Same layout as the triangle records: center, squared radius and inverse
+//radius as float arrays of sphRecordStride entries. Spheres are stored in
+//BVH leaf order too, so the spheres of a leaf are numbered consecutively and
+//load straight into the lanes of raySphereGroup().
+#define SPH_CENTER 0
+#define SPH_RADIUS2 3
+#define SPH_INV_RADIUS 4
+#define SPH_RECORD_ARRAYS 5
+
+float *sphRecords=NULL;
+size_t sphRecordStride=0;
+
+void buildSphereRecords()
+{
+    free(sphRecords);
+    sphRecords = allocRecords(SPH_RECORD_ARRAYS, num_spheres, &sphRecordStride);
     for(int i=0;i<num_spheres;i++)
     {
-        //Check for intersection of the ray with another object. 
-          if(i!=idx && raySphereIntersection(v, l, spheres[i]))
-          {
-            flag=true;
-          }
-    }
-    for(int j=0;j<num_triangles;j++)
-    {
-        if(rayTriangleIntersection(v, l, &triangles[j]))
-        {
-            flag=true;
-        }
-    }
-    
-    
-    if(flag){
-        //Setting the color to black
-        reflection[0] = 0;
-        reflection[1] = 0;
-        reflection[2] = 1;
-        direction->color_diffuse[0] = 0;
-        direction->color_diffuse[1] = 0;
-        direction->color_diffuse[2] = 0;
-        direction->color_specular[0] = 0;
-        direction->color_specular[1] = 0;
-        direction->color_specular[2] = 0;
+        for(int a=0;a<3;a++)
+            sphRecords[(SPH_CENTER+a)*sphRecordStride+i] = spheres[i].position[a];
+        sphRecords[SPH_RADIUS2*sphRecordStride+i] = spheres[i].radius*spheres[i].radius;
+        sphRecords[SPH_INV_RADIUS*sphRecordStride+i] = 1.0/spheres[i].radius;
     }
 }
 
-//SET COLOR FOR EACH SPHERE
-void computeSphereColor(Vertex *direction,float t,int idx)
+inline float sphRecord(int component, int idx)
 {
-    //CALCULATING DIFFUSE COMPONENT - Lecture 5.1 slide 30
-    //reversing the ray by multiplying it by -1
-    double l[3]={-1*(direction->position[0]*t)+lights[0].position[0],-1*(direction->position[1]*t)+lights[0].position[1],-1*(direction->position[2]*t)+lights[0].position[2]};
-    normalize(l);
-    
-    //l · n + clamping
-    float lDotn = dotProduct(l, direction->normal);
-    if(lDotn < 0.0)
-      lDotn = 0.0;
-    
-    //Id = kdLd(l · n)
-    direction->color_diffuse[0] = spheres[idx].color_diffuse[0]*lDotn;
-    direction->color_diffuse[1] = spheres[idx].color_diffuse[1]*lDotn;
-    direction->color_diffuse[2] = spheres[idx].color_diffuse[2]*lDotn;
-    
-    //CALCULATING SPECULAR COMPONENT - Lecture 5.1 slide 32
-    double v[3] = {-1*direction->position[0]*t,-1*direction->position[1]*t,-1*direction->position[2]*t};
-    
-    //r = 2(l · n)n - l
-    reflection[0] = (2*lDotn*direction->normal[0])-l[0];
-    reflection[1] = (2*lDotn*direction->normal[1])-l[1];
-    reflection[2] = (2*lDotn*direction->normal[2])-l[2]; 
-    
-    normalize(reflection);
-    normalize(v);
-    
-    //v · r + clamping
-    float rDotv = dotProduct(reflection, v);
-    if (rDotv <0.0)
-      rDotv = 0.0;
-    
-    //Is = ksLs(cos )^alpha
-    direction->color_specular[0] = spheres[idx].color_specular[0]* pow(rDotv,spheres[idx].shininess);
-    direction->color_specular[1] = spheres[idx].color_specular[1]* pow(rDotv,spheres[idx].shininess);
-    direction->color_specular[2] = spheres[idx].color_specular[2]* pow(rDotv,spheres[idx].shininess);
-
-    //Check if there is an object between the sphere and the light source. That is, there is a shadow
-    sphereShadowRays(direction, l, t, idx);
-}
-
-void getTriAreas(int idx, int t, Vertex *ray){
-    //area of triangle formed by ray, vertex 2 and vertex 3
-    areas[0] = fabs(
-                    ray->position[0]*t*(triangles[idx].v[1].position[1] - triangles[idx].v[2].position[1])
-                    +triangles[idx].v[1].position[0]*(triangles[idx].v[2].position[1] - ray->position[1]*t)
-                    +triangles[idx].v[2].position[0]*(ray->position[1]*t - triangles[idx].v[1].position[1])
-                    )/2;
-    
-    //area of triangle formed by ray, vertex 2 and vertex 3
-    areas[1] = fabs(
-                    triangles[idx].v[0].position[0]*(ray->position[1]*t - triangles[idx].v[2].position[1])
-                    +ray->position[0]*t*(triangles[idx].v[2].position[1] - triangles[idx].v[0].position[1])
-                    +triangles[idx].v[2].position[0]*(triangles[idx].v[0].position[1] - ray->position[1]*t)
-                    )/2;
-    
-    //area of triangle formed by ray, vertex 2 and vertex 3
-    areas[2] = fabs(
-                    triangles[idx].v[0].position[0]*(triangles[idx].v[1].position[1] - ray->position[1]*t)
-                    +triangles[idx].v[1].position[0]*(ray->position[1]*t - triangles[idx].v[0].position[1])
-                    +ray->position[0]*t*(triangles[idx].v[0].position[1] - triangles[idx].v[1].position[1])
-                    )/2;
+    return sphRecords[component*sphRecordStride+idx];
+}
+
+//returns the nearest positive root, the far one when the ray starts inside
+//the sphere, or 0 for a miss. The discriminant comes from the distance
+//between the center and the ray, which stays accurate for small spheres far
+//away, and the second root is c/q so there is one sqrt and no cancellation.
+float raySphereIntersection(const float org[3], const float direction[3], int idx)
+{
+    float o[3] = {org[0]-sphRecord(SPH_CENTER,idx),org[1]-sphRecord(SPH_CENTER+1,idx),org[2]-sphRecord(SPH_CENTER+2,idx)};
+    float r2 = sphRecord(SPH_RADIUS2,idx);
 
+    float a = direction[0]*direction[0]+direction[1]*direction[1]+direction[2]*direction[2];
+    float invA = 1/a;
+    float b = o[0]*direction[0]+o[1]*direction[1]+o[2]*direction[2];
+    float c = o[0]*o[0]+o[1]*o[1]+o[2]*o[2]-r2;
+
+    //l = o - (o·d/d·d) d is the closest approach of the ray to the center
+    float l[3] = {o[0]-b*invA*direction[0],o[1]-b*invA*direction[1],o[2]-b*invA*direction[2]};
+    float determinant = r2-(l[0]*l[0]+l[1]*l[1]+l[2]*l[2]);
+    if(determinant < 0.0) //Solution Exists only if sqrt(D) is Real (not Imaginary)
+      return 0;
+
+    float root = sqrtf(a*determinant);
+    float q = (b < 0) ? root-b : -(b+root);
+    if(q == 0)
+      return 0;
+    float t0 = q*invA, t1 = c/q;
+    float tNear = t0 < t1 ? t0 : t1, tFar = t0 < t1 ? t1 : t0;
+    if(tFar <= 0)
+      return 0;
+    return (tNear > 0) ? tNear : tFar;
 }
 
-void triShadowRays(Vertex *direction, double *l, float t, int idx){
-  double ray[3] = {direction->position[0]*t,direction->position[1]*t,direction->position[2]*t};
-    bool flag=false;
-    for(int i=0;i<num_spheres;i++)
+//One ray against the count (at most 8) spheres starting at first, returns
+//the mask of spheres hit in front of tMax with their distances in t[]
+int raySphereGroup(const float org[3], const float direction[3], int first, int count, float tMax, float t[8])
+{
+    //a lone sphere is cheaper without the vector setup
+    if(count == 1)
     {
-        if(raySphereIntersection(ray, l, spheres[i]))
-        {
-            flag=true;
-        }
+        t[0] = raySphereIntersection(org, direction, first);
+        return (t[0] > 0 && t[0] < tMax) ? 1 : 0;
     }
-    for(int j=0;j<num_triangles-1;j++)
+    static const float lanes[8] = {0,1,2,3,4,5,6,7};
+    vfloat8 o[3], d[3];
+    for(int a=0;a<3;a++)
     {
-        if(j!=idx && rayTriangleIntersection(ray, l, &triangles[j]))
-        {
-            flag=true;
-        }
-    }
-    if(flag){
-        reflection[0] = 0;
-        reflection[1] = 0;
-        reflection[2] = 1;
-        direction->color_diffuse[0] = 0;
-        direction->color_diffuse[1] = 0;
-        direction->color_diffuse[2] = 0;
-        direction->color_specular[0] = 0;
-        direction->color_specular[1] = 0;
-        direction->color_specular[2] = 0;
+        d[a] = vset1(direction[a]);
+        o[a] = vsub(vset1(org[a]),vload(&sphRecords[(SPH_CENTER+a)*sphRecordStride+first]));
     }
-}
+    vfloat8 r2 = vload(&sphRecords[SPH_RADIUS2*sphRecordStride+first]);
 
-//SET COLOR FOR EACH TRAINGLE
-void  computeTriangleColor(Vertex *direction,float t,int idx,int s)
-{
-    getTriAreas(idx,t,direction);
-    totalArea = areas[0]+areas[1]+areas[2];
-    float alpha, beta, gamma;
-    alpha = areas[0]/totalArea;
-    beta = areas[1]/totalArea;
-    gamma = areas[2]/totalArea;
-
-    ////CALCULATING NORMAL COMPONENT Ref- Lecture 8.2 Slide 22 
-    //Barycentric Coordinates for triangle normals
-    direction->normal[0] = alpha*triangles[idx].v[0].normal[0]+beta*triangles[idx].v[1].normal[0]+gamma*triangles[idx].v[2].normal[0];
-    direction->normal[1] = alpha*triangles[idx].v[0].normal[1]+beta*triangles[idx].v[1].normal[1]+gamma*triangles[idx].v[2].normal[1];
-    direction->normal[2] = alpha*triangles[idx].v[0].normal[2]+beta*triangles[idx].v[1].normal[2]+gamma*triangles[idx].v[2].normal[2];
-    normalize(direction->normal);
-
-    double light[3]={-direction->position[0]*t+lights[s].position[0],-direction->position[1]*t+lights[s].position[1],-direction->position[2]*t+lights[s].position[2]}; 
-    normalize(light);
-    
-    float lDotn = dotProduct(light, direction->normal);
-    if(lDotn < 0.0)
-      lDotn = 0.0;
-    
-    double point1[3] = {triangles[idx].v[0].color_diffuse[0]*lDotn, triangles[idx].v[0].color_diffuse[1]*lDotn, triangles[idx].v[0].color_diffuse[2]*lDotn}; 
-    
-    double point2[3] = {triangles[idx].v[1].color_diffuse[0]*lDotn, triangles[idx].v[1].color_diffuse[1]*lDotn, triangles[idx].v[1].color_diffuse[2]*lDotn};
-    
-    double point3[3] = {triangles[idx].v[2].color_diffuse[0]*lDotn, triangles[idx].v[2].color_diffuse[1]*lDotn, triangles[idx].v[2].color_diffuse[2]*lDotn}; //blue
+    float a = direction[0]*direction[0]+direction[1]*direction[1]+direction[2]*direction[2];
+    vfloat8 va = vset1(a), invA = vset1(1/a), zero = vset1(0.0f);
+    vfloat8 b = vadd(vadd(vmul(o[0],d[0]),vmul(o[1],d[1])),vmul(o[2],d[2]));
+    vfloat8 c = vsub(vadd(vadd(vmul(o[0],o[0]),vmul(o[1],o[1])),vmul(o[2],o[2])),r2);
+    vfloat8 s = vmul(b,invA);
+    vfloat8 l[3];
+    for(int k=0;k<3;k++)
+        l[k] = vsub(o[k],vmul(s,d[k]));
+    vfloat8 determinant = vsub(r2,vadd(vadd(vmul(l[0],l[0]),vmul(l[1],l[1])),vmul(l[2],l[2])));
+    vfloat8 valid = vand(vle(zero,determinant),vlt(vload(lanes),vset1((float)count)));
 
-    //CALCULATING DIFFUSE COMPONENT 
-    direction->color_diffuse[0] = alpha*point1[0]+beta*point2[0]+gamma*point3[0];
-    direction->color_diffuse[1] = alpha*point1[1]+beta*point2[1]+gamma*point3[1];
-    direction->color_diffuse[2] = alpha*point1[2]+beta*point2[2]+gamma*point3[2];
-    
-    
-    //CALCULATING SPECULAR COMPONENT 
-    double v[3] = {-direction->position[0]*t,-direction->position[1]*t,-direction->position[2]*t};
-    
-    reflection[0] = (2*lDotn*direction->normal[0])-light[0];
-    reflection[1] = (2*lDotn*direction->normal[1])-light[1];
-    reflection[2] = (2*lDotn*direction->normal[2])-light[2];
-    normalize(reflection);
-    normalize(v);
-
-    float rDotv = dotProduct(reflection, v);
-    if(rDotv<0.0)
-      rDotv = 0.0;
-    
-    double point1Specular[3] = {triangles[idx].v[0].color_specular[0]* pow(rDotv,triangles[idx].v[0].shininess), triangles[idx].v[0].color_specular[1]* pow(rDotv,triangles[idx].v[0].shininess), triangles[idx].v[0].color_specular[2]* pow(rDotv,triangles[idx].v[0].shininess)};
-    
-    double point2Specular[3] = {triangles[idx].v[1].color_specular[0]* pow(rDotv,triangles[idx].v[1].shininess), triangles[idx].v[1].color_specular[1]* pow(rDotv,triangles[idx].v[1].shininess), triangles[idx].v[1].color_specular[2]* pow(rDotv,triangles[idx].v[1].shininess)};
-    
-    double point3Specular[3] = {triangles[idx].v[2].color_specular[0]* pow(rDotv,triangles[idx].v[2].shininess), triangles[idx].v[2].color_specular[1]* pow(rDotv,triangles[idx].v[2].shininess), triangles[idx].v[2].color_specular[2]* pow(rDotv,triangles[idx].v[2].shininess)}; 
-    
-    direction->color_specular[0] = alpha*point1Specular[0]+beta*point2Specular[0]+gamma*point3Specular[0];
-    direction->color_specular[1] = alpha*point1Specular[1]+beta*point2Specular[1]+gamma*point3Specular[1];
-    direction->color_specular[2] = alpha*point1Specular[2]+beta*point2Specular[2]+gamma*point3Specular[2];
-    triShadowRays(direction,light,t,idx);
+    vfloat8 root = vsqrt(vmax(vmul(va,determinant),zero));
+    vfloat8 q = vselect(vlt(b,zero),vsub(root,b),vsub(zero,vadd(b,root)));
+    vfloat8 t0 = vmul(q,invA), t1 = vdiv(c,q);
+    vfloat8 tNear = vmin(t0,t1), tFar = vmax(t0,t1);
+    vfloat8 tHit = vselect(vlt(zero,tNear),tNear,tFar);
+    valid = vand(valid,vand(vlt(zero,tHit),vlt(tHit,vset1(tMax))));
+    vstore(t,tHit);
+    return vmask(valid);
 }
 
+//BOUNDING VOLUME HIERARCHY
+//Built once after loadScene() over every triangle and sphere, so a ray only
+//has to test the primitives whose boxes it actually passes through.
+#define PRIM_TRIANGLE 0
+#define PRIM_SPHERE 1
 
-//MODIFY THIS FUNCTION
-void draw_scene()
-{
-    getImageBorders();
-    float tMin=-1;
-    int kMin=-1;
-    for(int i=0;i<HEIGHT;i++)
-    {
-        glPointSize(2.0);
-        glBegin(GL_POINTS);
-        for(int j=0;j<WIDTH;j++)
-        {
-            //normalizing the direction vector
-            normalize(vertices[i][j].position);
-            bool flag=false;
-            float minDistance=100000;
-            //Check if Ray intersects with any Triangle and get 1st point of intersection
-            for(int k=0;k<num_triangles;k++)
-            {
-                float t = rayTriangleIntersection(origin,vertices[i][j].position, &triangles[k]);
-                if(t!=0)
-                {
-                    float distance  = sqrtf( pow(vertices[i][j].position[0]*t-vertices[i][j].position[0],2)+pow(vertices[i][j].position[1]*t-vertices[i][j].position[1],2)+pow(vertices[i][j].position[2]*t-vertices[i][j].position[2],2));
-                    if (distance<minDistance){
-                        minDistance=distance;
-                        tMin=t;
-                        kMin=k;
-                    }
-                    flag=true;
-                }
-            }
+//type masks for closestHit()
+#define HIT_TRIANGLES 1
+#define HIT_SPHERES 2
+#define HIT_ALL (HIT_TRIANGLES|HIT_SPHERES)
 
-            if(flag){
-                finalColor[0]=0.0;
-                finalColor[1]=0.0;
-                finalColor[2]=0.0;
-                
-                for(int x=0;x<num_lights;x++){//summing all the color values
-                    computeTriangleColor(&vertices[i][j],tMin,kMin,x);
-                    finalColor[0]+=lights[x].color[0]*(vertices[i][j].color_diffuse[0]+vertices[i][j].color_specular[0]);
-                    finalColor[1]+=lights[x].color[1]*(vertices[i][j].color_diffuse[1]+vertices[i][j].color_specular[1]);
-                    finalColor[2]+=lights[x].color[2]*(vertices[i][j].color_diffuse[2]+vertices[i][j].color_specular[2]);
-                }
-                
-                //Adding ambient color
-                finalColor[0]+=ambient_light[0];
-                finalColor[1]+=ambient_light[1];
-                finalColor[2]+=ambient_light[2];
-                
-                if(finalColor[0]>1.0){
-                  finalColor[0] = 1.0;
-                }else if(finalColor[0]<0.0){
-                  finalColor[0] = 0.0;
-                }
-                if(finalColor[1]>1.0){
-                  finalColor[1] = 1.0;
-                }else if(finalColor[1]<0.0){
-                  finalColor[1] = 0.0;
-                }
-                if(finalColor[2]>1.0){
-                  finalColor[2] = 1.0;
-                }else if(finalColor[2]<0.0){
-                  finalColor[2] = 0.0;
-                }
-                plot_pixel(j,i,finalColor[0]*255,finalColor[1]*255,finalColor[2]*255);
-            }
-            
-            //Check if Ray intersects with Sphere
-            for(int y=0;y<num_spheres;y++)
-            {
-                float t=raySphereIntersection(origin,vertices[i][j].position,spheres[y]);
-                if(t!=0)
-                {
-                    getSphereNormal(vertices[i][j].normal,vertices[i][j].position,t,y);
-                    computeSphereColor(&vertices[i][j],t,y);
-                    
-                    double finalColor[3]={lights[0].color[0]*ambient_light[0]+vertices[i][j].color_diffuse[0]+vertices[i][j].color_specular[0], lights[0].color[1]*ambient_light[1]+vertices[i][j].color_diffuse[1]+vertices[i][j].color_specular[1], lights[0].color[2]*ambient_light[2]+vertices[i][j].color_diffuse[2]+vertices[i][j].color_specular[2]};
-                    
-                    if(finalColor[0]>1.0){
-                      finalColor[0] = 1.0;
-                    }else if(finalColor[0]<0.0){
-                      finalColor[0] = 0.0;
-                    }
-                    if(finalColor[1]>1.0){
-                      finalColor[1] = 1.0;
-                    }else if(finalColor[1]<0.0){
-                      finalColor[1] = 0.0;
-                    }
-                    if(finalColor[2]>1.0){
-                      finalColor[2] = 1.0;
-                    }else if(finalColor[2]<0.0){
-                      finalColor[2] = 0.0;
-                    }
-                    plot_pixel(j,i,finalColor[0]*255,finalColor[1]*255,finalColor[2]*255);
-                }
-            }
-        }
-        glEnd();
-        glFlush();
-    }
-    printf("Done!\n"); fflush(stdout);
-}
+#define BVH_MAX_LEAF 4
+//past this depth nodes are split at the median so traversal stacks stay small
+#define BVH_MAX_SAH_DEPTH 64
+//split candidates per axis of the binned SAH
+#define BVH_BINS 32
+//subtrees with fewer primitives are built as independent tasks
+#define BVH_TASK_PRIMS 4096
+//nodes with at least this many primitives are binned by all threads together
+#define BVH_PARALLEL_PRIMS 65536
+#define BVH_STACK_SIZE 128
+//slab exits are scaled up by a few ulps: the slab and triangle tests round
+//differently, so an exact exit culls hits that graze the face of a flat box
+#define BOX_FAR_SCALE (1.0f+16*FLT_EPSILON)
 
-void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b)
-{
-  glColor3f(((double)r)/256.f,((double)g)/256.f,((double)b)/256.f);
-  glVertex2i(x,y);
-}
+//which structure closestHit() and occluded() traverse, set with --accel.
+//Ray packets always walk the binary BVH, bvh8q and grid do not build one and
+//trace without packets.
+#define ACCEL_BVH2 0
+#define ACCEL_BVH8 1
+#define ACCEL_BVH8Q 2
+#define ACCEL_GRID 3
+const char *accelNames[] = {"bvh2","bvh8","bvh8q","grid"};
+int accel=ACCEL_BVH8;
 
-void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b)
+//what an intersection query found: distance along the ray, primitive and,
+//for triangles, the barycentric weights u (v1) and v (v2)
+struct Hit
 {
-  buffer[HEIGHT-y-1][x][0]=r;
-  buffer[HEIGHT-y-1][x][1]=g;
-  buffer[HEIGHT-y-1][x][2]=b;
-}
+  float t;
+  float u, v;
+  int type;
+  int idx;
+};
 
-void plot_pixel(int x,int y,unsigned char r,unsigned char g, unsigned char b)
+//interior nodes keep their children next to each other at leftFirst and
+//leftFirst+1, leaves (count>0) point at count entries of bvhPrims
+struct BVHNode
 {
-  plot_pixel_display(x,y,r,g,b);
-  if(mode == MODE_JPEG)
-      plot_pixel_jpeg(x,y,r,g,b);
-}
+  float bmin[3];
+  int leftFirst;
+  float bmax[3];
+  int count;
+};
 
-void save_jpg()
+struct BVHBuildPrim
 {
-  Pic *in = NULL;
-
-  in = pic_alloc(640, 480, 3, NULL);
-  printf("Saving JPEG file: %s\n", filename);
+  float bmin[3];
+  float bmax[3];
+  float centroid[3];
+  int ref;
+};
 
-  memcpy(in->pix,buffer,3*WIDTH*HEIGHT);
-  if (jpeg_write(filename, in))
-    printf("File saved Successfully\n");
-  else
-    printf("Error in Saving\n");
+//primitive references are packed as (idx<<1)|type
+std::vector<BVHNode> bvhNodes;
+std::vector<int> bvhPrims;
 
-  pic_free(in);      
+//box around every triangle and sphere whatever the accelerator, the camera
+//controls scale their step by it. Inverted for an empty scene.
+struct SceneBounds
+{
+  float bmin[3];
+  float bmax[3];
+};
+SceneBounds sceneBounds;
 
+float surfaceArea(const float bmin[3], const float bmax[3])
+{
+    float dx = bmax[0]-bmin[0], dy = bmax[1]-bmin[1], dz = bmax[2]-bmin[2];
+    return 2*(dx*dy + dy*dz + dz*dx);
 }
 
-void parse_check(char *expected,char *found)
+void growBounds(float *bmin, float *bmax, const float pmin[3], const float pmax[3])
 {
-  if(strcasecmp(expected,found))
+    for(int a=0;a<3;a++)
     {
-      char error[100];
-      printf("Expected '%s ' found '%s '\n",expected,found);
-      printf("Parse error, abnormal abortion\n");
-      exit(0);
+        bmin[a] = std::min(bmin[a], pmin[a]);
+        bmax[a] = std::max(bmax[a], pmax[a]);
     }
-
 }
 
-void parse_doubles(FILE*file, char *check, double p[3])
+void resetBounds(float *bmin, float *bmax)
 {
-  char str[100];
-  fscanf(file,"%s",str);
-  parse_check(check,str);
-  fscanf(file,"%lf %lf %lf",&p[0],&p[1],&p[2]);
-  printf("%s %lf %lf %lf\n",check,p[0],p[1],p[2]);
+    for(int a=0;a<3;a++)
+    {
+        bmin[a] = FLT_MAX;
+        bmax[a] = -FLT_MAX;
+    }
 }
 
-void parse_rad(FILE*file,double *r)
+//fills num_threads from the hardware when --threads was not given
+void resolveThreads()
 {
-  char str[100];
-  fscanf(file,"%s",str);
-  parse_check("rad:",str);
-  fscanf(file,"%lf",r);
-  printf("rad: %f\n",*r);
+    if(num_threads <= 0)
+        num_threads = std::thread::hardware_concurrency();
+    if(num_threads <= 0)
+        num_threads = 1;
 }
 
-void parse_shi(FILE*file,double *shi)
+//Binned SAH build: centroids are sorted into BVH_BINS bins per axis and the
+//cost is only evaluated between bins, which is O(n) per node instead of a
+//sort. The partition collects the children's bounds on the way. Nodes above
+//BVH_PARALLEL_PRIMS split their binning pass across the threads, subtrees
+//below BVH_TASK_PRIMS are queued as tasks built in parallel into their own
+//arrays and appended afterwards. Both thresholds are fixed, so the tree is
+//the same for any thread count.
+struct BVHBin
 {
-  char s[100];
-  fscanf(file,"%s",s);
-  parse_check("shi:",s);
-  fscanf(file,"%lf",shi);
-  printf("shi: %f\n",*shi);
-}
+    float bmin[3];
+    float bmax[3];
+    int count;
+};
 
-int loadScene(char *argv)
+//bounds of a node's primitives and the bins of its split search
+struct BVHRangeBounds
 {
-  FILE *file = fopen(argv,"r");
-  int number_of_objects;
-  char type[50];
-  int i;
-  Triangle t;
-  Sphere s;
-  Light l;
-  fscanf(file,"%i",&number_of_objects);
-
-  printf("number of objects: %i\n",number_of_objects);
-  char str[200];
-
-  parse_doubles(file,"amb:",ambient_light);
-
-  for(i=0;i < number_of_objects;i++)
-    {
-      fscanf(file,"%s\n",type);
-      printf("%s\n",type);
-      if(strcasecmp(type,"triangle")==0)
-	{
-
-	  printf("found triangle\n");
-	  int j;
+    float bmin[3], bmax[3];	//primitive bounds
+    float cmin[3], cmax[3];	//centroid bounds
+};
 
-	  for(j=0;j < 3;j++)
-	    {
-	      parse_doubles(file,"pos:",t.v[j].position);
-	      parse_doubles(file,"nor:",t.v[j].normal);
-	      parse_doubles(file,"dif:",t.v[j].color_diffuse);
-	      parse_doubles(file,"spe:",t.v[j].color_specular);
-	      parse_shi(file,&t.v[j].shininess);
-	    }
+struct BVHRangeBins
+{
+    BVHBin bins[3][BVH_BINS];
+};
 
-	  if(num_triangles == MAX_TRIANGLES)
-	    {
-	      printf("too many triangles, you should increase MAX_TRIANGLES!\n");
-	      exit(0);
-	    }
-	  triangles[num_triangles++] = t;
-	}
-      else if(strcasecmp(type,"sphere")==0)
-	{
-	  printf("found sphere\n");
+void mergeRange(BVHRangeBounds *into, const BVHRangeBounds &part)
+{
+    growBounds(into->bmin, into->bmax, part.bmin, part.bmax);
+    growBounds(into->cmin, into->cmax, part.cmin, part.cmax);
+}
 
-	  parse_doubles(file,"pos:",s.position);
-	  parse_rad(file,&s.radius);
-	  parse_doubles(file,"dif:",s.color_diffuse);
-	  parse_doubles(file,"spe:",s.color_specular);
-	  parse_shi(file,&s.shininess);
+void mergeRange(BVHRangeBins *into, const BVHRangeBins &part)
+{
+    for(int a=0;a<3;a++)
+        for(int k=0;k<BVH_BINS;k++)
+        {
+            BVHBin &bin = into->bins[a][k];
+            growBounds(bin.bmin, bin.bmax, part.bins[a][k].bmin, part.bins[a][k].bmax);
+            bin.count += part.bins[a][k].count;
+        }
+}
 
-	  if(num_spheres == MAX_SPHERES)
-	    {
-	      printf("too many spheres, you should increase MAX_SPHERES!\n");
-	      exit(0);
-	    }
-	  spheres[num_spheres++] = s;
-	}
-      else if(strcasecmp(type,"light")==0)
-	{
-	  printf("found light\n");
-	  parse_doubles(file,"pos:",l.position);
-	  parse_doubles(file,"col:",l.color);
+//centroid position to bin along one axis, scale maps the centroid extent
+//onto [0,bins)
+inline int binIndex(float c, float cmin, float scale, int bins)
+{
+    int k = (int)((c-cmin)*scale);
+    return k < 0 ? 0 : (k >= bins ? bins-1 : k);
+}
 
-	  if(num_lights == MAX_LIGHTS)
-	    {
-	      printf("too many lights, you should increase MAX_LIGHTS!\n");
-	      exit(0);
-	    }
-	  lights[num_lights++] = l;
-	}
-      else
-	{
-	  printf("unknown type in scene description:\n%s\n",type);
-	  exit(0);
-	}
-    }
-  return 0;
+void resetRange(BVHRangeBounds *info)
+{
+    resetBounds(info->bmin, info->bmax);
+    resetBounds(info->cmin, info->cmax);
 }
 
-void display()
+inline void addToRange(BVHRangeBounds *info, const BVHBuildPrim &prim)
 {
+    growBounds(info->bmin, info->bmax, prim.bmin, prim.bmax);
+    growBounds(info->cmin, info->cmax, prim.centroid, prim.centroid);
+}
 
+void boundRange(const BVHBuildPrim *prims, int n, BVHRangeBounds *info)
+{
+    resetRange(info);
+    for(int i=0;i<n;i++)
+        addToRange(info, prims[i]);
 }
 
-void init()
+void binRange(const BVHBuildPrim *prims, int n, const float cmin[3], const float scale[3], int bins, BVHRangeBins *info)
 {
-  glMatrixMode(GL_PROJECTION);
-  glOrtho(0,WIDTH,0,HEIGHT,1,-1);
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+    for(int a=0;a<3;a++)
+        for(int k=0;k<bins;k++)
+        {
+            resetBounds(info->bins[a][k].bmin, info->bins[a][k].bmax);
+            info->bins[a][k].count = 0;
+        }
+    for(int i=0;i<n;i++)
+        for(int a=0;a<3;a++)
+        {
+            BVHBin &bin = info->bins[a][binIndex(prims[i].centroid[a], cmin[a], scale[a], bins)];
+            growBounds(bin.bmin, bin.bmax, prims[i].bmin, prims[i].bmax);
+            bin.count++;
+        }
+}
 
-  glClearColor(1,1,1,1);
-  glClear(GL_COLOR_BUFFER_BIT);
+//runs body(chunk, begin, end) over threads equal chunks of [0,n), the
+//calling thread takes the first one
+template <class Body>
+void parallelChunks(int n, int threads, Body body)
+{
+    std::vector<std::thread> workers;
+    for(int k=1;k<threads;k++)
+        workers.push_back(std::thread(body, k, (int)((long)k*n/threads), (int)((long)(k+1)*n/threads)));
+    body(0, 0, (int)((long)n/threads));
+    for(size_t k=0;k<workers.size();k++)
+        workers[k].join();
 }
 
-void idle()
+//runs pass(first, count, part) over threads chunks of the n primitives and
+//merges the parts into *info
+template <class Info, class Pass>
+void parallelPass(const BVHBuildPrim *prims, int n, int threads, Info *info, Pass pass)
 {
-  //hack to make it only draw once
-  static int once=0;
-  if(!once)
-  {
-      draw_scene();
-      if(mode == MODE_JPEG)
-	save_jpg();
-    }
-  once=1;
+    std::vector<Info> parts(threads);
+    parallelChunks(n, threads, [&](int k, int begin, int end) { pass(prims+begin, end-begin, &parts[k]); });
+    *info = parts[0];
+    for(int k=1;k<threads;k++)
+        mergeRange(info, parts[k]);
 }
 
-int main (int argc, char ** argv)
+//a subtree left for the task phase, node is its root in bvhNodes
+struct BVHTask
 {
-  if (argc<2 || argc > 3)
-  {  
-    printf ("usage: %s <scenefile> [jpegname]\n", argv[0]);
-    exit(0);
+    int node;
+    int begin, end;
+    int depth;
+    BVHRangeBounds bounds;
+};
+
+//Builds the node over prims[begin,end) into nodes, leaves index leafPrims.
+//info holds the bounds of the range, collected by the parent's partition.
+//With tasks set, this is the upper part of the tree: large nodes use every
+//thread and small subtrees are pushed to tasks instead of being built.
+void buildBVHNode(std::vector<BVHNode> &nodes, std::vector<int> &leafPrims, int nodeIdx, std::vector<BVHBuildPrim> &prims, int begin, int end, const BVHRangeBounds &info, int depth, std::vector<BVHTask> *tasks)
+{
+    int n = end-begin;
+    if(tasks && n > 1 && n < BVH_TASK_PRIMS)
+    {
+        BVHTask task = {nodeIdx, begin, end, depth, info};
+        tasks->push_back(task);
+        return;
+    }
+
+    int threads = (tasks && n >= BVH_PARALLEL_PRIMS) ? num_threads : 1;
+    BVHNode &node = nodes[nodeIdx];
+    memcpy(node.bmin, info.bmin, sizeof(node.bmin));
+    memcpy(node.bmax, info.bmax, sizeof(node.bmax));
+
+    float parentArea = surfaceArea(info.bmin, info.bmax);
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestBin = -1;
+    //small nodes get about one bin per primitive, so the per node cost
+    //stays proportional to its size
+    int numBins = std::min(n, BVH_BINS);
+    float scale[3];
+    for(int a=0;a<3;a++)
+    {
+        float extent = info.cmax[a]-info.cmin[a];
+        scale[a] = extent > 0 ? numBins/extent : 0;
+    }
+
+    if(n > 1)
+    {
+        BVHRangeBins binned;
+        if(threads > 1)
+        {
+            const float *cmin = info.cmin, *sc = scale;
+            parallelPass(&prims[begin], n, threads, &binned,
+                         [cmin, sc, numBins](const BVHBuildPrim *p, int count, BVHRangeBins *part) { binRange(p, count, cmin, sc, numBins, part); });
+        }
+        else
+            binRange(&prims[begin], n, info.cmin, scale, numBins, &binned);
+
+        //sweep the bins from both sides, a split after bin k puts bins
+        //0..k on the left
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        float bmin[3], bmax[3];
+        for(int axis=0;axis<3;axis++)
+        {
+            if(scale[axis] == 0)
+                continue;
+            const BVHBin *bins = binned.bins[axis];
+            resetBounds(bmin, bmax);
+            int count = 0;
+            for(int k=numBins-1;k>0;k--)
+            {
+                growBounds(bmin, bmax, bins[k].bmin, bins[k].bmax);
+                count += bins[k].count;
+                rightArea[k] = surfaceArea(bmin, bmax);
+                rightCount[k] = count;
+            }
+            resetBounds(bmin, bmax);
+            count = 0;
+            for(int k=0;k<numBins-1;k++)
+            {
+                growBounds(bmin, bmax, bins[k].bmin, bins[k].bmax);
+                count += bins[k].count;
+                if(count == 0 || rightCount[k+1] == 0)
+                    continue;
+                float cost = surfaceArea(bmin, bmax)*count + rightArea[k+1]*rightCount[k+1];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = k;
+                }
+            }
+        }
+    }
+
+    //SAH: traversal step costs about as much as one primitive test
+    float leafCost = n;
+    float splitCost = (parentArea > 0 && bestAxis >= 0) ? 1 + bestCost/parentArea : leafCost;
+    if(n <= 1 || (n <= BVH_MAX_LEAF && splitCost >= leafCost))
+    {
+        node.leftFirst = leafPrims.size();
+        node.count = n;
+        for(int i=begin;i<end;i++)
+            leafPrims.push_back(prims[i].ref);
+        return;
+    }
+
+    int mid;
+    BVHRangeBounds left, right;
+    if(bestAxis < 0 || depth >= BVH_MAX_SAH_DEPTH)
+    {
+        //no usable bin split (all centroids in one spot) or too deep,
+        //split at the median of the widest centroid axis
+        int axis = 0;
+        for(int a=1;a<3;a++)
+            if(info.cmax[a]-info.cmin[a] > info.cmax[axis]-info.cmin[axis])
+                axis = a;
+        mid = begin+n/2;
+        std::nth_element(prims.begin()+begin, prims.begin()+mid, prims.begin()+end,
+                         [axis](const BVHBuildPrim &a, const BVHBuildPrim &b) { return a.centroid[axis] < b.centroid[axis]; });
+        boundRange(&prims[begin], mid-begin, &left);
+        boundRange(&prims[mid], end-mid, &right);
+    }
+    else
+    {
+        //partition on the bin and collect both children's bounds on the way
+        float cmin = info.cmin[bestAxis], sc = scale[bestAxis];
+        resetRange(&left);
+        resetRange(&right);
+        int i = begin, j = end;
+        while(i < j)
+        {
+            if(binIndex(prims[i].centroid[bestAxis], cmin, sc, numBins) <= bestBin)
+                addToRange(&left, prims[i++]);
+            else
+            {
+                std::swap(prims[i], prims[--j]);
+                addToRange(&right, prims[j]);
+            }
+        }
+        mid = i;
+    }
+
+    int child = nodes.size();
+    nodes.resize(child+2);
+    //node may have moved when the vector grew
+    nodes[nodeIdx].leftFirst = child;
+    nodes[nodeIdx].count = 0;
+    buildBVHNode(nodes, leafPrims, child, prims, begin, mid, left, depth+1, tasks);
+    buildBVHNode(nodes, leafPrims, child+1, prims, mid, end, right, depth+1, tasks);
+}
+
+//builds the queued subtrees on all threads and appends them to bvhNodes and
+//bvhPrims in queue order
+void buildBVHTasks(std::vector<BVHTask> &tasks, std::vector<BVHBuildPrim> &prims)
+{
+    int count = tasks.size();
+    std::vector<std::vector<BVHNode> > nodes(count);
+    std::vector<std::vector<int> > leafPrims(count);
+
+    //largest subtrees first so no thread is left with a big one at the end
+    std::vector<int> order(count);
+    for(int i=0;i<count;i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&tasks](int a, int b) { return tasks[a].end-tasks[a].begin > tasks[b].end-tasks[b].begin; });
+
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for(int k=next++;k<count;k=next++)
+        {
+            const BVHTask &task = tasks[order[k]];
+            std::vector<BVHNode> &local = nodes[order[k]];
+            local.reserve(2*(task.end-task.begin));
+            local.resize(1);
+            buildBVHNode(local, leafPrims[order[k]], 0, prims, task.begin, task.end, task.bounds, task.depth, NULL);
+        }
+    };
+    std::vector<std::thread> workers;
+    for(int k=1;k<std::min(num_threads,count);k++)
+        workers.push_back(std::thread(work));
+    work();
+    for(size_t k=0;k<workers.size();k++)
+        workers[k].join();
+
+    //local node 0 replaces the task's node, the rest are appended, so a
+    //local index i>0 becomes base+i-1
+    for(int t=0;t<count;t++)
+    {
+        int base = bvhNodes.size();
+        int primBase = bvhPrims.size();
+        std::vector<BVHNode> &local = nodes[t];
+        for(size_t i=0;i<local.size();i++)
+        {
+            BVHNode node = local[i];
+            if(node.count > 0)
+                node.leftFirst += primBase;
+            else
+                node.leftFirst += base-1;
+            if(i == 0)
+                bvhNodes[tasks[t].node] = node;
+            else
+                bvhNodes.push_back(node);
+        }
+        bvhPrims.insert(bvhPrims.end(), leafPrims[t].begin(), leafPrims[t].end());
+    }
+}
+
+void buildBVH8();
+void buildGrid(const std::vector<BVHBuildPrim> &prims);
+void reportAccel(int numPrims);
+
+//nothing to intersect, the trees are then only placeholders
+inline bool sceneEmpty()
+{
+    return num_triangles == 0 && num_spheres == 0;
+}
+
+//load order index of every triangle and sphere, kept through the leaf order
+//and the bvh8q renumbering
+std::vector<int> primOrigin[2];
+
+//true when a hit at t on primitive type/idx replaces the current hit. An
+//exact tie goes to triangles before spheres and then to the primitive loaded
+//first, so every accelerator keeps the same one whatever order it visits in.
+inline bool primBefore(int type, int idx, int otherType, int otherIdx)
+{
+    if(type != otherType)
+        return type < otherType;
+    return primOrigin[type][idx] < primOrigin[type][otherIdx];
+}
+
+inline bool nearerHit(float t, int type, int idx, const Hit *hit)
+{
+    if(t != hit->t || hit->idx < 0)
+        return t < hit->t;
+    return primBefore(type, idx, hit->type, hit->idx);
+}
+
+void buildBVH()
+{
+    ScopedTimer timer(PHASE_BUILD);
+    std::vector<BVHBuildPrim> prims(num_triangles+num_spheres);
+    for(int i=0;i<num_triangles;i++)
+    {
+        BVHBuildPrim &p = prims[i];
+        resetBounds(p.bmin, p.bmax);
+        for(int j=0;j<3;j++)
+        {
+            float pos[3] = {(float)triangles[i].v[j].position[0],(float)triangles[i].v[j].position[1],(float)triangles[i].v[j].position[2]};
+            growBounds(p.bmin, p.bmax, pos, pos);
+        }
+        p.ref = (i<<1)|PRIM_TRIANGLE;
+    }
+    for(int i=0;i<num_spheres;i++)
+    {
+        BVHBuildPrim &p = prims[num_triangles+i];
+        for(int a=0;a<3;a++)
+        {
+            p.bmin[a] = spheres[i].position[a]-spheres[i].radius;
+            p.bmax[a] = spheres[i].position[a]+spheres[i].radius;
+        }
+        p.ref = (i<<1)|PRIM_SPHERE;
+    }
+    resetBounds(sceneBounds.bmin, sceneBounds.bmax);
+    for(size_t i=0;i<prims.size();i++)
+        growBounds(sceneBounds.bmin, sceneBounds.bmax, prims[i].bmin, prims[i].bmax);
+    primOrigin[PRIM_TRIANGLE].resize(num_triangles);
+    primOrigin[PRIM_SPHERE].resize(num_spheres);
+    for(size_t i=0;i<prims.size();i++)
+        primOrigin[prims[i].ref&1][prims[i].ref>>1] = prims[i].ref>>1;
+    if(accel == ACCEL_GRID)
+    {
+        buildGrid(prims);
+        return;
+    }
+    for(size_t i=0;i<prims.size();i++)
+        for(int a=0;a<3;a++)
+            prims[i].centroid[a] = 0.5f*(prims[i].bmin[a]+prims[i].bmax[a]);
+
+    bvhNodes.clear();
+    bvhPrims.clear();
+    bvhNodes.reserve(2*prims.size()+1);
+    bvhPrims.reserve(prims.size());
+    bvhNodes.resize(1);
+    //an empty scene keeps an inverted root box as a placeholder, the
+    //traversals check sceneEmpty() before they look at any tree
+    if(prims.empty())
+    {
+        resetBounds(bvhNodes[0].bmin, bvhNodes[0].bmax);
+        bvhNodes[0].leftFirst = 0;
+        bvhNodes[0].count = 0;
+        buildBVH8();
+        buildTriangleRecords();
+        buildSphereRecords();
+        reportAccel(0);
+        return;
+    }
+    resolveThreads();
+    BVHRangeBounds bounds;
+    if(num_threads > 1 && prims.size() >= BVH_PARALLEL_PRIMS)
+        parallelPass(&prims[0], prims.size(), num_threads, &bounds, boundRange);
+    else
+        boundRange(&prims[0], prims.size(), &bounds);
+    std::vector<BVHTask> tasks;
+    buildBVHNode(bvhNodes, bvhPrims, 0, prims, 0, prims.size(), bounds, 0, &tasks);
+    buildBVHTasks(tasks, prims);
+
+    //store triangles and spheres in leaf order so a leaf's intersection
+    //records are adjacent, the copying is split across the threads
+    std::vector<int> source(bvhPrims.size());
+    int numOrdered[2] = {0,0};
+    for(size_t i=0;i<bvhPrims.size();i++)
+    {
+        int type = bvhPrims[i]&1;
+        source[i] = bvhPrims[i]>>1;
+        bvhPrims[i] = (numOrdered[type]++<<1)|type;
+    }
+    std::vector<Triangle> ordered(num_triangles);
+    std::vector<Sphere> orderedSpheres(num_spheres);
+    int threads = bvhPrims.size() >= BVH_PARALLEL_PRIMS ? num_threads : 1;
+    parallelChunks(bvhPrims.size(), threads, [&](int, int begin, int end) {
+        for(int i=begin;i<end;i++)
+        {
+            if((bvhPrims[i]&1) == PRIM_TRIANGLE)
+                ordered[bvhPrims[i]>>1] = triangles[source[i]];
+            else
+                orderedSpheres[bvhPrims[i]>>1] = spheres[source[i]];
+            primOrigin[bvhPrims[i]&1][bvhPrims[i]>>1] = source[i];
+        }
+    });
+    triangles.swap(ordered);
+    spheres.swap(orderedSpheres);
+    //the compressed tree renumbers the primitives again
+    buildBVH8();
+    buildTriangleRecords();
+    buildSphereRecords();
+    reportAccel(prims.size());
+}
+
+//Slab test, returns the entry distance or FLT_MAX when the box is missed
+//or lies beyond tMax
+float rayBoxIntersection(const float o[3], const float invDir[3], const BVHNode &node, float tMax)
+{
+    float t0 = 0, t1 = tMax;
+    for(int a=0;a<3;a++)
+    {
+        float tNear = (node.bmin[a]-o[a])*invDir[a];
+        float tFar = (node.bmax[a]-o[a])*invDir[a];
+        if(tNear > tFar)
+        {
+            float temp = tNear;
+            tNear = tFar;
+            tFar = temp;
+        }
+        tFar *= BOX_FAR_SCALE;
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if(t0 > t1)
+            return FLT_MAX;
+    }
+    return t0;
+}
+
+//count consecutive spheres from first, 8 at a time
+inline void spheresClosestHit(const float o[3], const float fdir[3], int first, int count, Hit *hit, TraversalCount &counter)
+{
+    for(int group=first;group<first+count;group+=8)
+    {
+        float t[8];
+        int size = std::min(8,first+count-group);
+        //a sphere exactly at hit->t may still win the tie
+        int mask = raySphereGroup(o, fdir, group, size, nextafterf(hit->t, FLT_MAX), t);
+        counter.spheres += size;
+        for(int k=0;mask;k++,mask>>=1)
+            if((mask&1) && nearerHit(t[k], PRIM_SPHERE, group+k, hit))
+            {
+                hit->t = t[k];
+                hit->u = 0;
+                hit->v = 0;
+                hit->type = PRIM_SPHERE;
+                hit->idx = group+k;
+            }
+    }
+}
+
+inline bool spheresOccluded(const float o[3], const float fdir[3], int first, int count, float tMax, int skipType, int skipIdx, TraversalCount &counter)
+{
+    for(int group=first;group<first+count;group+=8)
+    {
+        float t[8];
+        int size = std::min(8,first+count-group);
+        int mask = raySphereGroup(o, fdir, group, size, tMax, t);
+        counter.spheres += size;
+        if(skipType == PRIM_SPHERE && skipIdx >= group && skipIdx < group+size)
+            mask &= ~(1<<(skipIdx-group));
+        if(mask)
+            return true;
+    }
+    return false;
+}
+
+//tests the count primitives of a leaf starting at bvhPrims[first] and keeps
+//the nearest hit of the requested types
+inline void leafClosestHit(const float o[3], const float fdir[3], int first, int count, int types, Hit *hit, TraversalCount &counter)
+{
+    int sphereFirst = 0, sphereCount = 0;
+    for(int i=0;i<count;i++)
+    {
+        int ref = bvhPrims[first+i];
+        int type = ref&1, idx = ref>>1;
+        if(type == PRIM_SPHERE)
+        {
+            //the spheres of a leaf are numbered consecutively
+            if(sphereCount++ == 0)
+                sphereFirst = idx;
+            continue;
+        }
+        if(!(types & HIT_TRIANGLES))
+            continue;
+        float u, v;
+        float t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+        counter.triangles++;
+        if(t > 0 && nearerHit(t, type, idx, hit))
+        {
+            hit->t = t;
+            hit->u = u;
+            hit->v = v;
+            hit->type = type;
+            hit->idx = idx;
+        }
+    }
+    if(types & HIT_SPHERES)
+        spheresClosestHit(o, fdir, sphereFirst, sphereCount, hit, counter);
+}
+
+//true when a primitive of the leaf other than skipType/skipIdx blocks the
+//ray before tMax
+inline bool leafOccluded(const float o[3], const float fdir[3], int first, int count, float tMax, int skipType, int skipIdx, TraversalCount &counter)
+{
+    int sphereFirst = 0, sphereCount = 0;
+    for(int i=0;i<count;i++)
+    {
+        int ref = bvhPrims[first+i];
+        int type = ref&1, idx = ref>>1;
+        if(type == PRIM_SPHERE)
+        {
+            if(sphereCount++ == 0)
+                sphereFirst = idx;
+            continue;
+        }
+        if(type == skipType && idx == skipIdx)
+            continue;
+        float u, v;
+        float t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+        counter.triangles++;
+        if(t > 0 && t < tMax)
+            return true;
+    }
+    return spheresOccluded(o, fdir, sphereFirst, sphereCount, tMax, skipType, skipIdx, counter);
+}
+
+//WIDE BVH
+//The binary tree collapsed so every node holds up to 8 children, their boxes
+//stored as one row of 8 floats per axis so a ray tests all of them with a
+//single vfloat8 slab test. Leaves stay the binary tree's bvhPrims ranges.
+struct BVH8Node
+{
+    float bmin[3][8];
+    float bmax[3][8];
+    int child[8];	//wide node index, or the first bvhPrims entry of a leaf
+    int count[8];	//primitives of a leaf, 0 for an inner node or empty slot
+};
+
+std::vector<BVH8Node> bvh8Nodes;
+
+//stack entries are wide node indices, leaves are stored as ~(first<<3|count)
+static_assert(BVH_MAX_LEAF < 8, "leaf counts must fit in 3 bits");
+//every wide node pops one entry and pushes at most 8
+#define BVH8_STACK_SIZE (7*BVH_STACK_SIZE+1)
+
+//the binary nodes that become the children of the wide node over the
+//subtree at binaryIdx: the inner child with the largest surface area is
+//opened until all 8 slots are used, returns how many are
+int collapseSlots(int binaryIdx, int slots[8])
+{
+    int n = 0;
+    const BVHNode &root = bvhNodes[binaryIdx];
+    if(root.count > 0)
+        slots[n++] = binaryIdx;
+    else
+    {
+        slots[n++] = root.leftFirst;
+        slots[n++] = root.leftFirst+1;
+    }
+    while(n < 8)
+    {
+        int best = -1;
+        float bestArea = -1;
+        for(int k=0;k<n;k++)
+        {
+            const BVHNode &node = bvhNodes[slots[k]];
+            float area = surfaceArea(node.bmin, node.bmax);
+            if(node.count == 0 && area > bestArea)
+            {
+                best = k;
+                bestArea = area;
+            }
+        }
+        if(best < 0)
+            break;
+        int opened = bvhNodes[slots[best]].leftFirst;
+        slots[best] = opened;
+        slots[n++] = opened+1;
+    }
+    return n;
+}
+
+//fills wide node wideIdx from the binary subtree at binaryIdx
+void collapseBVH8(int wideIdx, int binaryIdx)
+{
+    int slots[8];
+    int n = collapseSlots(binaryIdx, slots);
+
+    BVH8Node wide;
+    for(int k=0;k<8;k++)
+    {
+        wide.child[k] = 0;
+        wide.count[k] = 0;
+        if(k >= n)
+        {
+            //an empty box that every slab test rejects
+            for(int a=0;a<3;a++)
+            {
+                wide.bmin[a][k] = FLT_MAX;
+                wide.bmax[a][k] = -FLT_MAX;
+            }
+            continue;
+        }
+        const BVHNode &node = bvhNodes[slots[k]];
+        for(int a=0;a<3;a++)
+        {
+            wide.bmin[a][k] = node.bmin[a];
+            wide.bmax[a][k] = node.bmax[a];
+        }
+        if(node.count > 0)
+        {
+            wide.child[k] = node.leftFirst;
+            wide.count[k] = node.count;
+        }
+        else
+        {
+            wide.child[k] = bvh8Nodes.size();
+            bvh8Nodes.push_back(wide);
+        }
+    }
+    bvh8Nodes[wideIdx] = wide;
+    for(int k=0;k<n;k++)
+        if(wide.count[k] == 0)
+            collapseBVH8(wide.child[k], slots[k]);
+}
+
+void buildBVH8Q();
+
+void buildBVH8()
+{
+    bvh8Nodes.clear();
+    if(accel == ACCEL_BVH8Q)
+    {
+        buildBVH8Q();
+        return;
+    }
+    if(accel != ACCEL_BVH8)
+        return;
+    bvh8Nodes.reserve(bvhNodes.size()/4+1);
+    bvh8Nodes.resize(1);
+    if(bvhPrims.empty())
+    {
+        BVH8Node &root = bvh8Nodes[0];
+        for(int k=0;k<8;k++)
+        {
+            root.child[k] = 0;
+            root.count[k] = 0;
+            for(int a=0;a<3;a++)
+            {
+                root.bmin[a][k] = FLT_MAX;
+                root.bmax[a][k] = -FLT_MAX;
+            }
+        }
+        return;
+    }
+    collapseBVH8(0, 0);
+}
+
+//one ray against the 8 child boxes of a wide node: the near planes are
+//picked by the direction's signs once per ray, so each axis is two
+//multiplies and the lanes that hit come back as a bit mask with their
+//entry distances in tNear
+struct WideRay
+{
+    vfloat8 o[3], invDir[3], invDirFar[3];
+    int nearIsMax[3];
+};
+
+inline WideRay makeWideRay(const float o[3], const float invDir[3])
+{
+    WideRay ray;
+    for(int a=0;a<3;a++)
+    {
+        ray.o[a] = vset1(o[a]);
+        ray.invDir[a] = vset1(invDir[a]);
+        ray.invDirFar[a] = vset1(invDir[a]*BOX_FAR_SCALE);
+        ray.nearIsMax[a] = invDir[a] < 0;
+    }
+    return ray;
+}
+
+inline int wideBoxIntersection(const WideRay &ray, const BVH8Node &node, float tMax, float tNear[8])
+{
+    vfloat8 t0 = vset1(0), t1 = vset1(tMax);
+    for(int a=0;a<3;a++)
+    {
+        const float *nearPlane = ray.nearIsMax[a] ? node.bmax[a] : node.bmin[a];
+        const float *farPlane = ray.nearIsMax[a] ? node.bmin[a] : node.bmax[a];
+        t0 = vmax(vmul(vsub(vload(nearPlane),ray.o[a]),ray.invDir[a]),t0);
+        t1 = vmin(vmul(vsub(vload(farPlane),ray.o[a]),ray.invDirFar[a]),t1);
+    }
+    vstore(tNear,t0);
+    return vmask(vle(t0,t1));
+}
+
+bool closestHitWide(const float o[3], const float fdir[3], const float invDir[3], int types, Hit *hit)
+{
+    TraversalCount count;
+    WideRay ray = makeWideRay(o, invDir);
+    int stack[BVH8_STACK_SIZE];
+    float stackT[BVH8_STACK_SIZE];
+    int sp = 0;
+    stack[sp] = 0;
+    stackT[sp++] = 0;
+    while(sp > 0)
+    {
+        sp--;
+        //skip subtrees that start beyond the hit found since they were pushed
+        if(stackT[sp] > hit->t)
+            continue;
+        int entry = stack[sp];
+        count.nodes++;
+        if(entry < 0)
+        {
+            leafClosestHit(o, fdir, (~entry)>>3, (~entry)&7, types, hit, count);
+            continue;
+        }
+        const BVH8Node &node = bvh8Nodes[entry];
+        float tNear[8];
+        int mask = wideBoxIntersection(ray, node, hit->t, tNear);
+
+        //push the children that were hit far to near so the nearest is
+        //popped first
+        int order[8];
+        int hits = 0;
+        for(;mask;mask&=mask-1)
+        {
+            int k = __builtin_ctz(mask);
+            int i = hits++;
+            for(;i>0 && tNear[order[i-1]] < tNear[k];i--)
+                order[i] = order[i-1];
+            order[i] = k;
+        }
+        for(int i=0;i<hits;i++)
+        {
+            int k = order[i];
+            stack[sp] = node.count[k] > 0 ? ~((node.child[k]<<3)|node.count[k]) : node.child[k];
+            stackT[sp++] = tNear[k];
+        }
+    }
+    return hit->idx >= 0;
+}
+
+bool occludedWide(const float o[3], const float fdir[3], const float invDir[3], float tMax, int skipType, int skipIdx)
+{
+    TraversalCount count;
+    WideRay ray = makeWideRay(o, invDir);
+    int stack[BVH8_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+    {
+        int entry = stack[--sp];
+        count.nodes++;
+        if(entry < 0)
+        {
+            if(leafOccluded(o, fdir, (~entry)>>3, (~entry)&7, tMax, skipType, skipIdx, count))
+                return true;
+            continue;
+        }
+        const BVH8Node &node = bvh8Nodes[entry];
+        float tNear[8];
+        for(int mask=wideBoxIntersection(ray, node, tMax, tNear);mask;mask&=mask-1)
+        {
+            int k = __builtin_ctz(mask);
+            stack[sp++] = node.count[k] > 0 ? ~((node.child[k]<<3)|node.count[k]) : node.child[k];
+        }
+    }
+    return false;
+}
+
+//COMPRESSED WIDE BVH
+//--accel bvh8q stores the same 8-wide tree in 92 byte nodes instead of 256
+//and drops the binary tree and bvhPrims. Child boxes are 8 bit offsets in
+//steps of scale from the origin of the node's box, rounded outwards. Inner
+//children are stored consecutively from innerBase. Primitives are renumbered
+//so the leaf children of a node cover consecutive triangles from
+//triangleBase and spheres from sphereBase, in slot order.
+struct BVH8QNode
+{
+    float origin[3];
+    float scale[3];
+    unsigned char qmin[3][8];
+    unsigned char qmax[3][8];
+    int innerBase;
+    int triangleBase;
+    int sphereBase;
+    unsigned char meta[8];	//CHILD_EMPTY, CHILD_INNER|ordinal or a leaf's counts
+};
+
+#define CHILD_EMPTY 0
+#define CHILD_INNER 0x80
+//a leaf has triangles in the low 3 bits and spheres in the next 3
+#define LEAF_META(triangles, spheres) ((triangles)|((spheres)<<3))
+#define LEAF_TRIANGLES(meta) ((meta)&7)
+#define LEAF_SPHERES(meta) (((meta)>>3)&7)
+
+std::vector<BVH8QNode> bvh8qNodes;
+
+//the plane of quantized offset q, the traversal decodes the same way
+inline float dequantize(float origin, float scale, int q)
+{
+    return origin + (float)q*scale;
+}
+
+//fills compressed node nodeIdx from the binary subtree at binaryIdx, the
+//leaf primitives are appended to triangles/spheres in their new order
+void collapseBVH8Q(int nodeIdx, int binaryIdx, std::vector<Triangle> &orderedTriangles, std::vector<Sphere> &orderedSpheres, std::vector<int> orderedOrigin[2])
+{
+    int slots[8];
+    int n = collapseSlots(binaryIdx, slots);
+
+    BVH8QNode node;
+    float bmin[3], bmax[3];
+    resetBounds(bmin, bmax);
+    for(int k=0;k<n;k++)
+        growBounds(bmin, bmax, bvhNodes[slots[k]].bmin, bvhNodes[slots[k]].bmax);
+    for(int a=0;a<3;a++)
+    {
+        //255 steps must reach the far side of the box
+        node.origin[a] = bmin[a];
+        float scale = (bmax[a]-bmin[a])/255;
+        while(scale > 0 && dequantize(bmin[a], scale, 255) < bmax[a])
+            scale = nextafterf(scale, FLT_MAX);
+        node.scale[a] = scale;
+    }
+
+    int numInner = 0;
+    node.triangleBase = orderedTriangles.size();
+    node.sphereBase = orderedSpheres.size();
+    for(int k=0;k<8;k++)
+    {
+        if(k >= n)
+        {
+            node.meta[k] = CHILD_EMPTY;
+            for(int a=0;a<3;a++)
+            {
+                node.qmin[a][k] = 255;
+                node.qmax[a][k] = 0;
+            }
+            continue;
+        }
+        const BVHNode &child = bvhNodes[slots[k]];
+        for(int a=0;a<3;a++)
+        {
+            float origin = node.origin[a], scale = node.scale[a];
+            int lo = 0, hi = 0;
+            if(scale > 0)
+            {
+                lo = std::max(0, std::min(255, (int)floorf((child.bmin[a]-origin)/scale)));
+                hi = std::max(0, std::min(255, (int)ceilf((child.bmax[a]-origin)/scale)));
+                while(lo > 0 && dequantize(origin, scale, lo) > child.bmin[a])
+                    lo--;
+                while(hi < 255 && dequantize(origin, scale, hi) < child.bmax[a])
+                    hi++;
+            }
+            node.qmin[a][k] = lo;
+            node.qmax[a][k] = hi;
+        }
+        if(child.count == 0)
+        {
+            node.meta[k] = CHILD_INNER|numInner++;
+            continue;
+        }
+        int numTriangles = 0, numSpheres = 0;
+        for(int i=0;i<child.count;i++)
+        {
+            int ref = bvhPrims[child.leftFirst+i];
+            if((ref&1) == PRIM_TRIANGLE)
+            {
+                orderedTriangles.push_back(triangles[ref>>1]);
+                orderedOrigin[PRIM_TRIANGLE].push_back(primOrigin[PRIM_TRIANGLE][ref>>1]);
+                numTriangles++;
+            }
+        }
+        for(int i=0;i<child.count;i++)
+        {
+            int ref = bvhPrims[child.leftFirst+i];
+            if((ref&1) == PRIM_SPHERE)
+            {
+                orderedSpheres.push_back(spheres[ref>>1]);
+                orderedOrigin[PRIM_SPHERE].push_back(primOrigin[PRIM_SPHERE][ref>>1]);
+                numSpheres++;
+            }
+        }
+        node.meta[k] = LEAF_META(numTriangles, numSpheres);
+    }
+
+    node.innerBase = bvh8qNodes.size();
+    bvh8qNodes.resize(node.innerBase+numInner);
+    bvh8qNodes[nodeIdx] = node;
+    for(int k=0;k<n;k++)
+        if(node.meta[k] & CHILD_INNER)
+            collapseBVH8Q(node.innerBase+(node.meta[k]&~CHILD_INNER), slots[k], orderedTriangles, orderedSpheres, orderedOrigin);
+}
+
+//replaces the binary tree with the compressed one
+void buildBVH8Q()
+{
+    bvh8qNodes.clear();
+    bvh8qNodes.reserve(bvhNodes.size()/4+1);
+    bvh8qNodes.resize(1);
+    std::vector<Triangle> orderedTriangles;
+    std::vector<Sphere> orderedSpheres;
+    std::vector<int> orderedOrigin[2];
+    orderedTriangles.reserve(triangles.size());
+    orderedSpheres.reserve(spheres.size());
+    orderedOrigin[PRIM_TRIANGLE].reserve(triangles.size());
+    orderedOrigin[PRIM_SPHERE].reserve(spheres.size());
+    if(bvhPrims.empty())
+    {
+        BVH8QNode &root = bvh8qNodes[0];
+        memset(&root, 0, sizeof(root));
+        for(int a=0;a<3;a++)
+            for(int k=0;k<8;k++)
+                root.qmin[a][k] = 255;
+    }
+    else
+        collapseBVH8Q(0, 0, orderedTriangles, orderedSpheres, orderedOrigin);
+    bvh8qNodes.shrink_to_fit();
+    triangles.swap(orderedTriangles);
+    spheres.swap(orderedSpheres);
+    primOrigin[PRIM_TRIANGLE].swap(orderedOrigin[PRIM_TRIANGLE]);
+    primOrigin[PRIM_SPHERE].swap(orderedOrigin[PRIM_SPHERE]);
+
+    std::vector<BVHNode>().swap(bvhNodes);
+    std::vector<int>().swap(bvhPrims);
+}
+
+//UNIFORM GRID
+//--accel grid skips the BVH build and bins every primitive's box into a
+//grid of about GRID_DENSITY cells per primitive with a counting sort, so the
+//build is two linear passes. Rays walk the cells in order with a 3D-DDA.
+#define GRID_DENSITY 4
+#define GRID_MAX_RES 512
+//recently tested primitives a ray remembers so one spanning several cells
+//is not tested again, a power of two
+#define GRID_MAILBOX 32
+//a primitive spanning more cells than this and more than a
+//GRID_LARGE_FRACTION of the grid is not binned but kept in a list every ray
+//tests, so one huge sphere cannot fill every cell
+#define GRID_MAX_PRIM_CELLS 4096
+#define GRID_LARGE_FRACTION 8
+//the cells get coarser until the binned references average at most
+//GRID_MAX_REFS_PER_PRIM per primitive, small scenes may always use
+//GRID_MIN_REF_BUDGET
+#define GRID_MAX_REFS_PER_PRIM 16
+#define GRID_MIN_REF_BUDGET (1u<<24)
+
+struct Grid
+{
+    float bmin[3], bmax[3];
+    int res[3];
+    float cellSize[3], invCellSize[3];
+    std::vector<uint32_t> offsets;	//cell c holds refs[offsets[c]..offsets[c+1])
+    std::vector<int> refs;	//(idx<<1)|type as in bvhPrims
+    std::vector<int> large;	//primitives tested by every ray
+};
+
+Grid grid;
+
+inline int gridCell(int x, int y, int z)
+{
+    return (z*grid.res[1]+y)*grid.res[0]+x;
+}
+
+//cell range covered by a box along axis a, widened by a thousandth of a
+//cell so a ray the DDA walks through a neighbouring cell at an edge still
+//finds it
+inline void gridSpan(const float bmin[3], const float bmax[3], int a, int *lo, int *hi)
+{
+    float lower = (bmin[a]-grid.bmin[a])*grid.invCellSize[a]-1e-3f;
+    float upper = (bmax[a]-grid.bmin[a])*grid.invCellSize[a]+1e-3f;
+    *lo = std::max(0, std::min(grid.res[a]-1, (int)floorf(lower)));
+    *hi = std::max(0, std::min(grid.res[a]-1, (int)floorf(upper)));
+}
+
+//true when ref was already tested by this ray, otherwise remembers it
+inline bool gridMailbox(int mailbox[GRID_MAILBOX], int ref)
+{
+    int slot = ((unsigned int)ref*2654435761u)>>27;
+    if(mailbox[slot] == ref)
+        return true;
+    mailbox[slot] = ref;
+    return false;
+}
+
+//cells a box spans at the current resolution
+inline uint64_t gridPrimCells(const BVHBuildPrim &prim)
+{
+    uint64_t cells = 1;
+    for(int a=0;a<3;a++)
+    {
+        int lo, hi;
+        gridSpan(prim.bmin, prim.bmax, a, &lo, &hi);
+        cells *= hi-lo+1;
+    }
+    return cells;
+}
+
+inline bool gridTooLarge(uint64_t cells)
+{
+    return cells > GRID_MAX_PRIM_CELLS && cells*GRID_LARGE_FRACTION > (uint64_t)grid.res[0]*grid.res[1]*grid.res[2];
+}
+
+//places the grid around the primitives marked in binned and picks the
+//resolution from their count, then unmarks the ones too large to bin
+void fitGrid(const std::vector<BVHBuildPrim> &prims, std::vector<char> &binned)
+{
+    float bmin[3], bmax[3];
+    resetBounds(bmin, bmax);
+    int n = 0;
+    for(size_t i=0;i<prims.size();i++)
+        if(binned[i])
+        {
+            growBounds(bmin, bmax, prims[i].bmin, prims[i].bmax);
+            n++;
+        }
+
+    //cells about cubic, flat boxes padded so every axis has some extent
+    float largest = 0;
+    for(int a=0;a<3;a++)
+    {
+        if(n == 0)
+        {
+            bmin[a] = 0;
+            bmax[a] = 0;
+        }
+        largest = std::max(largest, bmax[a]-bmin[a]);
+    }
+    float pad = largest > 0 ? 1e-4f*largest : 1e-4f;
+    double volume = 1;
+    for(int a=0;a<3;a++)
+    {
+        if(bmax[a]-bmin[a] < pad)
+        {
+            bmin[a] -= pad;
+            bmax[a] += pad;
+        }
+        volume *= bmax[a]-bmin[a];
+        grid.bmin[a] = bmin[a];
+        grid.bmax[a] = bmax[a];
+    }
+    n = std::max(n, 1);
+    double cellsPerUnit = cbrt(GRID_DENSITY*(double)n/volume);
+
+    //the references are counted in 64 bits first, while they would exceed
+    //the budget (which also keeps the 32 bit offsets from wrapping) the
+    //cells get coarser, at one cell per axis every box fits
+    uint64_t budget = std::max((uint64_t)GRID_MAX_REFS_PER_PRIM*n, (uint64_t)GRID_MIN_REF_BUDGET);
+    budget = std::min(budget, (uint64_t)UINT32_MAX);
+    for(;;)
+    {
+        for(int a=0;a<3;a++)
+        {
+            grid.res[a] = std::max(1, std::min(GRID_MAX_RES, (int)((bmax[a]-bmin[a])*cellsPerUnit+0.5)));
+            grid.cellSize[a] = (bmax[a]-bmin[a])/grid.res[a];
+            grid.invCellSize[a] = grid.res[a]/(bmax[a]-bmin[a]);
+        }
+        uint64_t total = 0;
+        for(size_t i=0;i<prims.size();i++)
+            if(binned[i])
+            {
+                uint64_t cells = gridPrimCells(prims[i]);
+                if(!gridTooLarge(cells))
+                    total += cells;
+            }
+        if(total <= budget || grid.res[0]*grid.res[1]*grid.res[2] == 1)
+            break;
+        cellsPerUnit *= std::min(0.9, cbrt((double)budget/total));
+    }
+    for(size_t i=0;i<prims.size();i++)
+        if(binned[i] && gridTooLarge(gridPrimCells(prims[i])))
+            binned[i] = 0;
+}
+
+void buildGrid(const std::vector<BVHBuildPrim> &prims)
+{
+    std::vector<BVHNode>().swap(bvhNodes);
+    std::vector<int>().swap(bvhPrims);
+    bvh8Nodes.clear();
+    bvh8qNodes.clear();
+
+    //when some primitives are too large to bin the grid is fitted again
+    //around the rest, so a huge sphere neither fills every cell nor
+    //stretches them over empty space
+    std::vector<char> binned(prims.size(), 1);
+    fitGrid(prims, binned);
+    if(std::count(binned.begin(), binned.end(), 0) > 0)
+        fitGrid(prims, binned);
+
+    //counting sort: count the cells each box overlaps, prefix sum, fill
+    int numCells = grid.res[0]*grid.res[1]*grid.res[2];
+    grid.offsets.assign(numCells+1, 0);
+    grid.large.clear();
+    int lo[3], hi[3];
+    for(size_t i=0;i<prims.size();i++)
+    {
+        if(!binned[i])
+        {
+            grid.large.push_back(prims[i].ref);
+            continue;
+        }
+        for(int a=0;a<3;a++)
+            gridSpan(prims[i].bmin, prims[i].bmax, a, &lo[a], &hi[a]);
+        for(int z=lo[2];z<=hi[2];z++)
+            for(int y=lo[1];y<=hi[1];y++)
+                for(int x=lo[0];x<=hi[0];x++)
+                    grid.offsets[gridCell(x,y,z)+1]++;
+    }
+    for(int c=0;c<numCells;c++)
+        grid.offsets[c+1] += grid.offsets[c];
+    grid.refs.resize(grid.offsets[numCells]);
+    std::vector<uint32_t> fill(grid.offsets.begin(), grid.offsets.end()-1);
+    for(size_t i=0;i<prims.size();i++)
+    {
+        if(!binned[i])
+            continue;
+        for(int a=0;a<3;a++)
+            gridSpan(prims[i].bmin, prims[i].bmax, a, &lo[a], &hi[a]);
+        for(int z=lo[2];z<=hi[2];z++)
+            for(int y=lo[1];y<=hi[1];y++)
+                for(int x=lo[0];x<=hi[0];x++)
+                    grid.refs[fill[gridCell(x,y,z)]++] = prims[i].ref;
+    }
+
+    buildTriangleRecords();
+    buildSphereRecords();
+    reportAccel(prims.size());
+}
+
+//DDA state: the current cell, the ray distance to the next boundary on each
+//axis and the distance between boundaries
+struct GridWalk
+{
+    int cell[3], step[3];
+    float tNext[3], tDelta[3];
+};
+
+//clips the ray to the grid, false when it misses or starts beyond tMax
+bool startGridWalk(const float o[3], const float fdir[3], const float invDir[3], float tMax, GridWalk *walk)
+{
+    float t0 = 0, t1 = tMax;
+    for(int a=0;a<3;a++)
+    {
+        float tNear = (grid.bmin[a]-o[a])*invDir[a];
+        float tFar = (grid.bmax[a]-o[a])*invDir[a];
+        if(tNear > tFar)
+            std::swap(tNear, tFar);
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if(t0 > t1)
+            return false;
+    }
+    for(int a=0;a<3;a++)
+    {
+        float p = o[a]+t0*fdir[a];
+        walk->cell[a] = std::max(0, std::min(grid.res[a]-1, (int)floorf((p-grid.bmin[a])*grid.invCellSize[a])));
+        if(fdir[a] == 0)
+        {
+            walk->step[a] = 0;
+            walk->tNext[a] = FLT_MAX;
+            walk->tDelta[a] = 0;
+            continue;
+        }
+        walk->step[a] = fdir[a] > 0 ? 1 : -1;
+        float boundary = grid.bmin[a]+(walk->cell[a]+(fdir[a] > 0))*grid.cellSize[a];
+        //an origin on a cell face can round to a boundary just behind it
+        walk->tNext[a] = std::max(t0, (boundary-o[a])*invDir[a]);
+        walk->tDelta[a] = grid.cellSize[a]*fabsf(invDir[a]);
+    }
+    return true;
+}
+
+//moves to the next cell, returns the distance where the left cell ended or
+//-1 once the walk leaves the grid
+inline float stepGridWalk(GridWalk *walk)
+{
+    int a = walk->tNext[0] < walk->tNext[1] ? (walk->tNext[0] < walk->tNext[2] ? 0 : 2) : (walk->tNext[1] < walk->tNext[2] ? 1 : 2);
+    float exit = walk->tNext[a];
+    walk->cell[a] += walk->step[a];
+    if(walk->step[a] == 0 || walk->cell[a] < 0 || walk->cell[a] >= grid.res[a])
+        return -1;
+    walk->tNext[a] += walk->tDelta[a];
+    return exit;
+}
+
+//closest hit over n primitive refs, the ones already in the mailbox are
+//skipped (no mailbox for the large list, which is tested once)
+inline void gridRefsClosestHit(const float o[3], const float fdir[3], const int *refs, uint32_t n, int types, int *mailbox, Hit *hit, TraversalCount &count)
+{
+    for(uint32_t i=0;i<n;i++)
+    {
+        int ref = refs[i];
+        int type = ref&1, idx = ref>>1;
+        if(mailbox && gridMailbox(mailbox, ref))
+            continue;
+        float t, u = 0, v = 0;
+        if(type == PRIM_TRIANGLE)
+        {
+            if(!(types & HIT_TRIANGLES))
+                continue;
+            t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+            count.triangles++;
+        }
+        else
+        {
+            if(!(types & HIT_SPHERES))
+                continue;
+            t = raySphereIntersection(o, fdir, idx);
+            count.spheres++;
+        }
+        if(t > 0 && nearerHit(t, type, idx, hit))
+        {
+            hit->t = t;
+            hit->u = u;
+            hit->v = v;
+            hit->type = type;
+            hit->idx = idx;
+        }
+    }
+}
+
+inline bool gridRefsOccluded(const float o[3], const float fdir[3], const int *refs, uint32_t n, float tMax, int skipType, int skipIdx, int *mailbox, TraversalCount &count)
+{
+    for(uint32_t i=0;i<n;i++)
+    {
+        int ref = refs[i];
+        int type = ref&1, idx = ref>>1;
+        if((type == skipType && idx == skipIdx) || (mailbox && gridMailbox(mailbox, ref)))
+            continue;
+        float t;
+        if(type == PRIM_TRIANGLE)
+        {
+            float u, v;
+            t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+            count.triangles++;
+        }
+        else
+        {
+            t = raySphereIntersection(o, fdir, idx);
+            count.spheres++;
+        }
+        if(t > 0 && t < tMax)
+            return true;
+    }
+    return false;
+}
+
+//a primitive can overlap several cells, so a hit only ends the walk once it
+//lies before the exit of the current cell. The large primitives are tested
+//first, they may lie outside the grid and their hit ends the walk as early
+//as any other.
+bool closestHitGrid(const float o[3], const float fdir[3], const float invDir[3], int types, Hit *hit)
+{
+    TraversalCount count;
+    GridWalk walk;
+    gridRefsClosestHit(o, fdir, grid.large.data(), grid.large.size(), types, NULL, hit, count);
+    if(!startGridWalk(o, fdir, invDir, FLT_MAX, &walk))
+        return hit->idx >= 0;
+    int mailbox[GRID_MAILBOX];
+    memset(mailbox, -1, sizeof(mailbox));
+    for(;;)
+    {
+        int c = gridCell(walk.cell[0], walk.cell[1], walk.cell[2]);
+        count.nodes++;
+        gridRefsClosestHit(o, fdir, grid.refs.data()+grid.offsets[c], grid.offsets[c+1]-grid.offsets[c], types, mailbox, hit, count);
+        float exit = std::min(walk.tNext[0], std::min(walk.tNext[1], walk.tNext[2]));
+        if(hit->t <= exit || stepGridWalk(&walk) < 0)
+            break;
+    }
+    return hit->idx >= 0;
+}
+
+bool occludedGrid(const float o[3], const float fdir[3], const float invDir[3], float tMax, int skipType, int skipIdx)
+{
+    TraversalCount count;
+    GridWalk walk;
+    if(gridRefsOccluded(o, fdir, grid.large.data(), grid.large.size(), tMax, skipType, skipIdx, NULL, count))
+        return true;
+    if(!startGridWalk(o, fdir, invDir, tMax, &walk))
+        return false;
+    int mailbox[GRID_MAILBOX];
+    memset(mailbox, -1, sizeof(mailbox));
+    for(;;)
+    {
+        int c = gridCell(walk.cell[0], walk.cell[1], walk.cell[2]);
+        count.nodes++;
+        if(gridRefsOccluded(o, fdir, grid.refs.data()+grid.offsets[c], grid.offsets[c+1]-grid.offsets[c], tMax, skipType, skipIdx, mailbox, count))
+            return true;
+        float exit = stepGridWalk(&walk);
+        if(exit < 0 || exit > tMax)
+            break;
+    }
+    return false;
+}
+
+//node count and the memory held by the trees and leaf lists
+void reportAccel(int numPrims)
+{
+    size_t bytes = bvhNodes.size()*sizeof(BVHNode) + bvhPrims.size()*sizeof(int) + bvh8Nodes.size()*sizeof(BVH8Node) + bvh8qNodes.size()*sizeof(BVH8QNode);
+    if(accel == ACCEL_GRID)
+    {
+        bytes += grid.offsets.size()*sizeof(uint32_t)+(grid.refs.size()+grid.large.size())*sizeof(int);
+        printf("Grid: %dx%dx%d cells over %d primitives (%d in every cell), %.1f MB\n",grid.res[0],grid.res[1],grid.res[2],numPrims,(int)grid.large.size(),bytes/1048576.0);
+    }
+    else if(accel == ACCEL_BVH8Q)
+        printf("BVH: %d compressed nodes over %d primitives, %.1f MB\n",(int)bvh8qNodes.size(),numPrims,bytes/1048576.0);
+    else
+        printf("BVH: %d nodes over %d primitives, %.1f MB\n",(int)bvhNodes.size(),numPrims,bytes/1048576.0);
+}
+
+//the wide slab test on dequantized boxes
+inline int quantizedBoxIntersection(const WideRay &ray, const BVH8QNode &node, float tMax, float tNear[8])
+{
+    vfloat8 t0 = vset1(0), t1 = vset1(tMax);
+    for(int a=0;a<3;a++)
+    {
+        vfloat8 origin = vset1(node.origin[a]), scale = vset1(node.scale[a]);
+        const unsigned char *nearPlane = ray.nearIsMax[a] ? node.qmax[a] : node.qmin[a];
+        const unsigned char *farPlane = ray.nearIsMax[a] ? node.qmin[a] : node.qmax[a];
+        vfloat8 lo = vadd(origin,vmul(vloadbytes(nearPlane),scale));
+        vfloat8 hi = vadd(origin,vmul(vloadbytes(farPlane),scale));
+        t0 = vmax(vmul(vsub(lo,ray.o[a]),ray.invDir[a]),t0);
+        t1 = vmin(vmul(vsub(hi,ray.o[a]),ray.invDirFar[a]),t1);
+    }
+    vstore(tNear,t0);
+    return vmask(vle(t0,t1));
+}
+
+//first triangle and sphere of every leaf child
+inline void leafOffsets(const BVH8QNode &node, int triangleFirst[8], int sphereFirst[8])
+{
+    int t = node.triangleBase, sp = node.sphereBase;
+    for(int k=0;k<8;k++)
+    {
+        triangleFirst[k] = t;
+        sphereFirst[k] = sp;
+        if(node.meta[k] != CHILD_EMPTY && !(node.meta[k] & CHILD_INNER))
+        {
+            t += LEAF_TRIANGLES(node.meta[k]);
+            sp += LEAF_SPHERES(node.meta[k]);
+        }
+    }
+}
+
+//leaf children are tested right away near to far, inner ones are pushed
+//far to near with their entry distance
+bool closestHitCompressed(const float o[3], const float fdir[3], const float invDir[3], int types, Hit *hit)
+{
+    TraversalCount count;
+    WideRay ray = makeWideRay(o, invDir);
+    int stack[BVH8_STACK_SIZE];
+    float stackT[BVH8_STACK_SIZE];
+    int sp = 0;
+    stack[sp] = 0;
+    stackT[sp++] = 0;
+    while(sp > 0)
+    {
+        sp--;
+        if(stackT[sp] > hit->t)
+            continue;
+        const BVH8QNode &node = bvh8qNodes[stack[sp]];
+        count.nodes++;
+        float tNear[8];
+        int mask = quantizedBoxIntersection(ray, node, hit->t, tNear);
+        int order[8];
+        int hits = 0;
+        for(;mask;mask&=mask-1)
+        {
+            int k = __builtin_ctz(mask);
+            if(node.meta[k] == CHILD_EMPTY)
+                continue;
+            int i = hits++;
+            for(;i>0 && tNear[order[i-1]] > tNear[k];i--)
+                order[i] = order[i-1];
+            order[i] = k;
+        }
+        for(int i=hits-1;i>=0;i--)
+        {
+            int k = order[i];
+            if(node.meta[k] & CHILD_INNER)
+            {
+                stack[sp] = node.innerBase+(node.meta[k]&~CHILD_INNER);
+                stackT[sp++] = tNear[k];
+            }
+        }
+        int triangleFirst[8], sphereFirst[8];
+        leafOffsets(node, triangleFirst, sphereFirst);
+        for(int i=0;i<hits;i++)
+        {
+            int k = order[i];
+            if((node.meta[k] & CHILD_INNER) || tNear[k] > hit->t)
+                continue;
+            if(types & HIT_TRIANGLES)
+                for(int idx=triangleFirst[k];idx<triangleFirst[k]+LEAF_TRIANGLES(node.meta[k]);idx++)
+                {
+                    float u, v;
+                    float t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+                    count.triangles++;
+                    if(t > 0 && nearerHit(t, PRIM_TRIANGLE, idx, hit))
+                    {
+                        hit->t = t;
+                        hit->u = u;
+                        hit->v = v;
+                        hit->type = PRIM_TRIANGLE;
+                        hit->idx = idx;
+                    }
+                }
+            if(types & HIT_SPHERES)
+                spheresClosestHit(o, fdir, sphereFirst[k], LEAF_SPHERES(node.meta[k]), hit, count);
+        }
+    }
+    return hit->idx >= 0;
+}
+
+bool occludedCompressed(const float o[3], const float fdir[3], const float invDir[3], float tMax, int skipType, int skipIdx)
+{
+    TraversalCount count;
+    WideRay ray = makeWideRay(o, invDir);
+    int stack[BVH8_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+    {
+        const BVH8QNode &node = bvh8qNodes[stack[--sp]];
+        count.nodes++;
+        float tNear[8];
+        int mask = quantizedBoxIntersection(ray, node, tMax, tNear);
+        int triangleFirst[8], sphereFirst[8];
+        leafOffsets(node, triangleFirst, sphereFirst);
+        for(;mask;mask&=mask-1)
+        {
+            int k = __builtin_ctz(mask);
+            int meta = node.meta[k];
+            if(meta == CHILD_EMPTY)
+                continue;
+            if(meta & CHILD_INNER)
+            {
+                stack[sp++] = node.innerBase+(meta&~CHILD_INNER);
+                continue;
+            }
+            for(int idx=triangleFirst[k];idx<triangleFirst[k]+LEAF_TRIANGLES(meta);idx++)
+            {
+                if(skipType == PRIM_TRIANGLE && idx == skipIdx)
+                    continue;
+                float u, v;
+                float t = rayTriangleIntersection(o, fdir, idx, &u, &v);
+                count.triangles++;
+                if(t > 0 && t < tMax)
+                    return true;
+            }
+            if(spheresOccluded(o, fdir, sphereFirst[k], LEAF_SPHERES(meta), tMax, skipType, skipIdx, count))
+                return true;
+        }
+    }
+    return false;
+}
+
+//Nearest primitive of the requested types along the ray, visiting the
+//closer child first so farther subtrees get culled by the current hit
+bool closestHit(const double org[3], const double direction[3], int types, Hit *hit)
+{
+    float o[3] = {(float)org[0],(float)org[1],(float)org[2]};
+    float fdir[3] = {(float)direction[0],(float)direction[1],(float)direction[2]};
+    float invDir[3] = {(float)(1.0/direction[0]),(float)(1.0/direction[1]),(float)(1.0/direction[2])};
+    hit->t = FLT_MAX;
+    hit->idx = -1;
+    if(sceneEmpty())
+        return false;
+    if(accel == ACCEL_BVH8)
+        return closestHitWide(o, fdir, invDir, types, hit);
+    if(accel == ACCEL_BVH8Q)
+        return closestHitCompressed(o, fdir, invDir, types, hit);
+    if(accel == ACCEL_GRID)
+        return closestHitGrid(o, fdir, invDir, types, hit);
+    TraversalCount count;
+
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    if(rayBoxIntersection(o, invDir, bvhNodes[0], hit->t) == FLT_MAX)
+        return false;
+    stack[sp++] = 0;
+    while(sp > 0)
+    {
+        const BVHNode &node = bvhNodes[stack[--sp]];
+        count.nodes++;
+        if(node.count > 0)
+        {
+            leafClosestHit(o, fdir, node.leftFirst, node.count, types, hit, count);
+            continue;
+        }
+        float tLeft = rayBoxIntersection(o, invDir, bvhNodes[node.leftFirst], hit->t);
+        float tRight = rayBoxIntersection(o, invDir, bvhNodes[node.leftFirst+1], hit->t);
+        int near = node.leftFirst, far = node.leftFirst+1;
+        if(tRight < tLeft)
+        {
+            float temp = tLeft;
+            tLeft = tRight;
+            tRight = temp;
+            near = node.leftFirst+1;
+            far = node.leftFirst;
+        }
+        if(tRight != FLT_MAX)
+            stack[sp++] = far;
+        if(tLeft != FLT_MAX)
+            stack[sp++] = near;
+    }
+    return hit->idx >= 0;
+}
+
+//Shadow query: true as soon as any primitive other than the shading one
+//(skipType/skipIdx) blocks the ray before tMax, no ordering needed
+bool occluded(const double org[3], const double direction[3], float tMax, int skipType, int skipIdx)
+{
+    float o[3] = {(float)org[0],(float)org[1],(float)org[2]};
+    float fdir[3] = {(float)direction[0],(float)direction[1],(float)direction[2]};
+    float invDir[3] = {(float)(1.0/direction[0]),(float)(1.0/direction[1]),(float)(1.0/direction[2])};
+    if(sceneEmpty())
+        return false;
+    if(accel == ACCEL_BVH8)
+        return occludedWide(o, fdir, invDir, tMax, skipType, skipIdx);
+    if(accel == ACCEL_BVH8Q)
+        return occludedCompressed(o, fdir, invDir, tMax, skipType, skipIdx);
+    if(accel == ACCEL_GRID)
+        return occludedGrid(o, fdir, invDir, tMax, skipType, skipIdx);
+    TraversalCount count;
+
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+    {
+        const BVHNode &node = bvhNodes[stack[--sp]];
+        count.nodes++;
+        if(rayBoxIntersection(o, invDir, node, tMax) == FLT_MAX)
+            continue;
+        if(node.count > 0)
+        {
+            if(leafOccluded(o, fdir, node.leftFirst, node.count, tMax, skipType, skipIdx, count))
+                return true;
+            continue;
+        }
+        stack[sp++] = node.leftFirst+1;
+        stack[sp++] = node.leftFirst;
+    }
+    return false;
+}
+
+//SURFACE SHADING
+//Everything about a hit point that does not depend on the light is gathered
+//once into a Surface, shadeSurface() then loops over the lights with one
+//shadow query each.
+#define MAX_LOBES 3
+
+struct Surface
+{
+  double point[3];
+  double normal[3];
+  double view[3];               //unit vector towards the eye
+  double diffuse[3];            //interpolated kd
+  double specular[MAX_LOBES][3];//ks of every vertex, already weighted
+  double shininess[MAX_LOBES];
+  int lobes;                    //1 when all vertices share the shininess
+  int type, idx;                //the primitive shadow rays skip
+};
+
+//Fills in the hit point and the vector back to the ray origin
+void setSurfacePoint(Surface *s, const double org[3], const double direction[3], float t)
+{
+    for(int a=0;a<3;a++)
+    {
+        s->point[a] = org[a]+direction[a]*t;
+        s->view[a] = -direction[a];
+    }
+}
+
+//SET COLOR FOR EACH SPHERE
+void sphereSurface(Surface *s, const double org[3], const double direction[3], const Hit &hit)
+{
+    const Sphere &sphere = spheres[hit.idx];
+    setSurfacePoint(s, org, direction, hit.t);
+    getSphereNormal(s->normal, s->point, hit.idx);
+    for(int a=0;a<3;a++)
+    {
+        s->diffuse[a] = sphere.color_diffuse[a];
+        s->specular[0][a] = sphere.color_specular[a];
+    }
+    s->shininess[0] = sphere.shininess;
+    s->lobes = 1;
+    s->type = PRIM_SPHERE;
+    s->idx = hit.idx;
+}
+
+//SET COLOR FOR EACH TRAINGLE
+void triangleSurface(Surface *s, const double org[3], const double direction[3], const Hit &hit)
+{
+    const Triangle &tri = triangles[hit.idx];
+    //barycentric weights of v0, v1 and v2 straight from the intersection test
+    double w[3] = {1.0f-hit.u-hit.v, hit.u, hit.v};
+
+    setSurfacePoint(s, org, direction, hit.t);
+    ////CALCULATING NORMAL COMPONENT Ref- Lecture 8.2 Slide 22
+    //Barycentric Coordinates for triangle normals and materials
+    for(int a=0;a<3;a++)
+    {
+        s->normal[a] = w[0]*tri.v[0].normal[a]+w[1]*tri.v[1].normal[a]+w[2]*tri.v[2].normal[a];
+        s->diffuse[a] = w[0]*tri.v[0].color_diffuse[a]+w[1]*tri.v[1].color_diffuse[a]+w[2]*tri.v[2].color_diffuse[a];
+    }
+    normalize(s->normal);
+
+    //the specular term is interpolated after the power, so vertices with
+    //different shininess each keep their own lobe
+    if(tri.v[0].shininess == tri.v[1].shininess && tri.v[0].shininess == tri.v[2].shininess)
+    {
+        for(int a=0;a<3;a++)
+            s->specular[0][a] = w[0]*tri.v[0].color_specular[a]+w[1]*tri.v[1].color_specular[a]+w[2]*tri.v[2].color_specular[a];
+        s->shininess[0] = tri.v[0].shininess;
+        s->lobes = 1;
+    }
+    else
+    {
+        for(int k=0;k<3;k++)
+        {
+            for(int a=0;a<3;a++)
+                s->specular[k][a] = w[k]*tri.v[k].color_specular[a];
+            s->shininess[k] = tri.v[k].shininess;
+        }
+        s->lobes = 3;
+    }
+    s->type = PRIM_TRIANGLE;
+    s->idx = hit.idx;
+}
+
+//Sums the Phong terms of every unblocked light plus the ambient light
+void shadeSurface(const Surface &s, double color[3])
+{
+    threadStats.shadingCalls++;
+    color[0] = ambient_light[0];
+    color[1] = ambient_light[1];
+    color[2] = ambient_light[2];
+
+    for(int x=0;x<num_lights;x++)
+    {
+        //CALCULATING DIFFUSE COMPONENT - Lecture 5.1 slide 30
+        double l[3] = {lights[x].position[0]-s.point[0],lights[x].position[1]-s.point[1],lights[x].position[2]-s.point[2]};
+        float lightDist = sqrt(dotProduct(l, l));
+        normalize(l);
+
+        //l · n + clamping
+        float lDotn = dotProduct(l, s.normal);
+        if(lDotn < 0.0)
+          lDotn = 0.0;
+
+        //CALCULATING SPECULAR COMPONENT - Lecture 5.1 slide 32
+        //r = 2(l · n)n - l
+        double reflection[3];
+        reflection[0] = (2*lDotn*s.normal[0])-l[0];
+        reflection[1] = (2*lDotn*s.normal[1])-l[1];
+        reflection[2] = (2*lDotn*s.normal[2])-l[2];
+        normalize(reflection);
+
+        //v · r + clamping
+        float rDotv = dotProduct(reflection, s.view);
+        if(rDotv < 0.0)
+          rDotv = 0.0;
+
+        //Id = kdLd(l · n), Is = ksLs(r · v)^alpha
+        double term[3] = {s.diffuse[0]*lDotn, s.diffuse[1]*lDotn, s.diffuse[2]*lDotn};
+        for(int k=0;k<s.lobes;k++)
+        {
+            double spec = pow(rDotv, s.shininess[k]);
+            term[0] += s.specular[k][0]*spec;
+            term[1] += s.specular[k][1]*spec;
+            term[2] += s.specular[k][2]*spec;
+        }
+        if(term[0] == 0.0 && term[1] == 0.0 && term[2] == 0.0)
+            continue;
+
+        //Check if there is an object between the point and the light source. That is, there is a shadow
+        threadStats.shadowRays++;
+        if(occluded(s.point, l, lightDist, s.type, s.idx))
+            continue;
+
+        color[0] += lights[x].color[0]*term[0];
+        color[1] += lights[x].color[1]*term[1];
+        color[2] += lights[x].color[2]*term[2];
+    }
+}
+
+
+//PACKET TRACING
+//Primary rays of 8 neighbouring pixels share a camera origin and point in
+//almost the same direction, so they walk the BVH together and every box and
+//primitive is tested against all 8 at once.
+#define PACKET_SIZE 8
+
+bool use_packets=true;
+
+struct RayPacket
+{
+  vfloat8 org[3];
+  vfloat8 dir[3];
+  vfloat8 invDir[3];
+};
+
+//lanes whose ray enters the box before their current closest hit. The
+//min/max slab test would accept an inverted (empty) box, so those miss.
+inline vfloat8 packetBoxMask(const RayPacket &p, const BVHNode &node, vfloat8 tBest)
+{
+    if(node.bmin[0] > node.bmax[0] || node.bmin[1] > node.bmax[1] || node.bmin[2] > node.bmax[2])
+        return vset1(0.0f);
+    vfloat8 tNear = vset1(0.0f), tFar = vset1(FLT_MAX);
+    for(int a=0;a<3;a++)
+    {
+        vfloat8 t0 = vmul(vsub(vset1(node.bmin[a]),p.org[a]),p.invDir[a]);
+        vfloat8 t1 = vmul(vsub(vset1(node.bmax[a]),p.org[a]),p.invDir[a]);
+        tNear = vmax(tNear,vmin(t0,t1));
+        tFar = vmin(tFar,vmax(t0,t1));
+    }
+    return vle(tNear,vmin(tBest,vmul(tFar,vset1(BOX_FAR_SCALE))));
+}
+
+//Möller–Trumbore on 8 rays, same tests as rayTriangleIntersection()
+inline vfloat8 packetTriangleIntersection(const RayPacket &p, int idx, vfloat8 *t, vfloat8 *u, vfloat8 *v)
+{
+    vfloat8 edge1[3], edge2[3], s[3];
+    for(int a=0;a<3;a++)
+    {
+        edge1[a] = vset1(triRecord(TRI_EDGE1+a,idx));
+        edge2[a] = vset1(triRecord(TRI_EDGE2+a,idx));
+        s[a] = vsub(p.org[a],vset1(triRecord(TRI_V0+a,idx)));
+    }
+    const float EPSILON = 0.0000001;
+    vfloat8 px = vsub(vmul(p.dir[1],edge2[2]),vmul(p.dir[2],edge2[1]));
+    vfloat8 py = vsub(vmul(p.dir[2],edge2[0]),vmul(p.dir[0],edge2[2]));
+    vfloat8 pz = vsub(vmul(p.dir[0],edge2[1]),vmul(p.dir[1],edge2[0]));
+    vfloat8 a = vadd(vadd(vmul(edge1[0],px),vmul(edge1[1],py)),vmul(edge1[2],pz));
+    //parallel rays fail here since |a| < EPSILON
+    vfloat8 valid = vor(vlt(a,vset1(-EPSILON)),vlt(vset1(EPSILON),a));
+    vfloat8 f = vdiv(vset1(1.0f),a);
+
+    *u = vmul(f,vadd(vadd(vmul(s[0],px),vmul(s[1],py)),vmul(s[2],pz)));
+    valid = vand(valid,vand(vle(vset1(0.0f),*u),vle(*u,vset1(1.0f))));
+
+    vfloat8 qx = vsub(vmul(s[1],edge1[2]),vmul(s[2],edge1[1]));
+    vfloat8 qy = vsub(vmul(s[2],edge1[0]),vmul(s[0],edge1[2]));
+    vfloat8 qz = vsub(vmul(s[0],edge1[1]),vmul(s[1],edge1[0]));
+    *v = vmul(f,vadd(vadd(vmul(p.dir[0],qx),vmul(p.dir[1],qy)),vmul(p.dir[2],qz)));
+    valid = vand(valid,vand(vle(vset1(0.0f),*v),vle(vadd(*u,*v),vset1(1.0f))));
+
+    *t = vmul(f,vadd(vadd(vmul(edge2[0],qx),vmul(edge2[1],qy)),vmul(edge2[2],qz)));
+    return vand(valid,vlt(vset1(EPSILON),*t));
+}
+
+//same roots as raySphereIntersection(): nearest positive one, or the far
+//one when the ray starts inside the sphere
+inline vfloat8 packetSphereIntersection(const RayPacket &p, int idx, vfloat8 *t)
+{
+    vfloat8 o[3];
+    for(int k=0;k<3;k++)
+        o[k] = vsub(p.org[k],vset1(sphRecord(SPH_CENTER+k,idx)));
+    vfloat8 r2 = vset1(sphRecord(SPH_RADIUS2,idx)), zero = vset1(0.0f);
+    vfloat8 a = vadd(vadd(vmul(p.dir[0],p.dir[0]),vmul(p.dir[1],p.dir[1])),vmul(p.dir[2],p.dir[2]));
+    vfloat8 invA = vdiv(vset1(1.0f),a);
+    vfloat8 b = vadd(vadd(vmul(p.dir[0],o[0]),vmul(p.dir[1],o[1])),vmul(p.dir[2],o[2]));
+    vfloat8 c = vsub(vadd(vadd(vmul(o[0],o[0]),vmul(o[1],o[1])),vmul(o[2],o[2])),r2);
+
+    vfloat8 s = vmul(b,invA), l[3];
+    for(int k=0;k<3;k++)
+        l[k] = vsub(o[k],vmul(s,p.dir[k]));
+    vfloat8 determinant = vsub(r2,vadd(vadd(vmul(l[0],l[0]),vmul(l[1],l[1])),vmul(l[2],l[2])));
+    vfloat8 valid = vle(zero,determinant);
+    vfloat8 root = vsqrt(vmax(vmul(a,determinant),zero));
+
+    vfloat8 q = vselect(vlt(b,zero),vsub(root,b),vsub(zero,vadd(b,root)));
+    vfloat8 t0 = vmul(q,invA), t1 = vdiv(c,q);
+    vfloat8 tNear = vmin(t0,t1), tFar = vmax(t0,t1);
+    valid = vand(valid,vlt(zero,tFar));
+    *t = vselect(vlt(zero,tNear),tNear,tFar);
+    return valid;
+}
+
+//closestHit() for a whole packet, hits[k] belongs to lane k
+void packetClosestHit(const RayPacket &p, int types, Hit hits[PACKET_SIZE])
+{
+    vfloat8 tBest = vset1(FLT_MAX), uBest = vset1(0.0f), vBest = vset1(0.0f);
+    int best[PACKET_SIZE];
+    for(int k=0;k<PACKET_SIZE;k++)
+    {
+        best[k] = -1;
+        hits[k].idx = -1;
+        hits[k].t = FLT_MAX;
+    }
+    if(sceneEmpty())
+        return;
+
+    float leadDir[3];
+    for(int a=0;a<3;a++)
+    {
+        float lanes[PACKET_SIZE];
+        vstore(lanes,p.dir[a]);
+        leadDir[a] = lanes[0];
+    }
+
+    //a packet counts one visit per node and PACKET_SIZE tests per primitive
+    TraversalCount count;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+    {
+        const BVHNode &node = bvhNodes[stack[--sp]];
+        count.nodes++;
+        if(!vmask(packetBoxMask(p,node,tBest)))
+            continue;
+        if(node.count > 0)
+        {
+            for(int i=0;i<node.count;i++)
+            {
+                int ref = bvhPrims[node.leftFirst+i];
+                int type = ref&1, idx = ref>>1;
+                vfloat8 t, u = vset1(0.0f), v = vset1(0.0f), valid;
+                if(type == PRIM_TRIANGLE)
+                {
+                    if(!(types & HIT_TRIANGLES))
+                        continue;
+                    valid = packetTriangleIntersection(p,idx,&t,&u,&v);
+                    count.triangles += PACKET_SIZE;
+                }
+                else
+                {
+                    if(!(types & HIT_SPHERES))
+                        continue;
+                    valid = packetSphereIntersection(p,idx,&t);
+                    count.spheres += PACKET_SIZE;
+                }
+                valid = vand(valid,vand(vlt(vset1(0.0f),t),vle(t,tBest)));
+                int mask = vmask(valid);
+                //lanes tied with their current hit keep the primitive
+                //closestHit() would
+                int ties = mask & vmask(vle(tBest,t));
+                if(ties)
+                {
+                    float laneMask[PACKET_SIZE];
+                    for(int k=0;k<PACKET_SIZE;k++)
+                    {
+                        if((ties & (1<<k)) && best[k] >= 0 && !primBefore(type, idx, best[k]&1, best[k]>>1))
+                            mask &= ~(1<<k);
+                        laneMask[k] = (mask & (1<<k)) ? 1.0f : 0.0f;
+                    }
+                    valid = vlt(vset1(0.0f),vload(laneMask));
+                }
+                if(!mask)
+                    continue;
+                tBest = vselect(valid,t,tBest);
+                uBest = vselect(valid,u,uBest);
+                vBest = vselect(valid,v,vBest);
+                for(int k=0;k<PACKET_SIZE;k++)
+                    if(mask & (1<<k))
+                        best[k] = ref;
+            }
+            continue;
+        }
+        //visit the child whose center lies first along the packet direction
+        const BVHNode &left = bvhNodes[node.leftFirst], &right = bvhNodes[node.leftFirst+1];
+        float order = 0;
+        for(int a=0;a<3;a++)
+            order += (right.bmin[a]+right.bmax[a]-left.bmin[a]-left.bmax[a])*leadDir[a];
+        if(order < 0)
+        {
+            stack[sp++] = node.leftFirst;
+            stack[sp++] = node.leftFirst+1;
+        }
+        else
+        {
+            stack[sp++] = node.leftFirst+1;
+            stack[sp++] = node.leftFirst;
+        }
+    }
+
+    float t[PACKET_SIZE], u[PACKET_SIZE], v[PACKET_SIZE];
+    vstore(t,tBest);
+    vstore(u,uBest);
+    vstore(v,vBest);
+    for(int k=0;k<PACKET_SIZE;k++)
+        if(best[k] >= 0)
+        {
+            hits[k].t = t[k];
+            hits[k].u = u[k];
+            hits[k].v = v[k];
+            hits[k].type = best[k]&1;
+            hits[k].idx = best[k]>>1;
+        }
+}
+
+//SHADING KERNEL
+//Shades the closest surface a primary ray hit and returns the clamped color.
+//Only touches locals and the ray, so tiles can run in parallel.
+bool shadePixel(const double direction[3], const Hit &hit, double finalColor[3])
+{
+    Surface surface;
+
+    if(hit.idx < 0)
+        return false;
+    if(hit.type == PRIM_SPHERE)
+        sphereSurface(&surface, origin, direction, hit);
+    else
+        triangleSurface(&surface, origin, direction, hit);
+
+    shadeSurface(surface, finalColor);
+    for(int c=0;c<3;c++)
+    {
+        if(finalColor[c]>1.0)
+            finalColor[c] = 1.0;
+        else if(finalColor[c]<0.0)
+            finalColor[c] = 0.0;
+    }
+    return true;
+}
+
+//Traces the primary ray of pixel (i,j) on its own
+bool tracePixel(int i, int j, double finalColor[3])
+{
+    //the ray and everything shaded along it live on the stack
+    double direction[3];
+    getPixelDirection(i,j,direction);
+    //normalizing the direction vector
+    normalize(direction);
+
+    Hit hit;
+    threadStats.primaryRays++;
+    closestHit(origin, direction, HIT_ALL, &hit);
+    return shadePixel(direction, hit, finalColor);
+}
+
+//Traces count (at most 8) pixels of row i at columns j, j+stride, ... as one
+//packet, unused lanes repeat the last pixel. Each result fills a block x block
+//square of the frame.
+void tracePacket(int i, int j, int stride, int count, int block)
+{
+    double directions[PACKET_SIZE][3];
+    float lanes[3][PACKET_SIZE];
+    for(int k=0;k<PACKET_SIZE;k++)
+    {
+        getPixelDirection(i,j+std::min(k,count-1)*stride,directions[k]);
+        normalize(directions[k]);
+        for(int a=0;a<3;a++)
+            lanes[a][k] = directions[k][a];
+    }
+    RayPacket p;
+    for(int a=0;a<3;a++)
+    {
+        p.org[a] = vset1((float)origin[a]);
+        p.dir[a] = vload(lanes[a]);
+        p.invDir[a] = vdiv(vset1(1.0f),p.dir[a]);
+    }
+
+    Hit hits[PACKET_SIZE];
+    threadStats.primaryRays += count;
+    packetClosestHit(p, HIT_ALL, hits);
+    for(int k=0;k<count;k++)
+    {
+        double color[3] = {0,0,0};
+        shadePixel(directions[k], hits[k], color);
+        plot_block(j+k*stride,i,block,color);
+    }
+}
+
+//Traces the pixels j0, j0+stride, ... below j1 of row i
+void traceRow(int i, int j0, int j1, int stride, int block)
+{
+    if(use_packets)
+    {
+        for(int j=j0;j<j1;j+=PACKET_SIZE*stride)
+            tracePacket(i,j,stride,std::min(PACKET_SIZE,(j1-j+stride-1)/stride),block);
+        return;
+    }
+    for(int j=j0;j<j1;j+=stride)
+    {
+        double color[3] = {0,0,0};
+        tracePixel(i,j,color);
+        plot_block(j,i,block,color);
+    }
+}
+
+//TILE SCHEDULER
+//The frame is cut into TILE_SIZE x TILE_SIZE tiles. Every worker starts with a
+//contiguous run of tiles in its own queue and, once that runs dry, steals from
+//the back of the other queues so a few expensive tiles cannot stall the frame.
+//
+//A frame may also be traced progressively: a pass of step s traces every s-th
+//pixel and fills the s x s block it stands for, then passes of s/2 ... 1 trace
+//the pixels the coarser passes skipped. Bumping renderGeneration makes the
+//workers drop the remaining tiles of a pass.
+#define TILE_SIZE 16
+//first progressive step, TILE_SIZE must be a multiple of it
+#define PREVIEW_STEP 8
+
+struct TileQueue
+{
+  std::mutex lock;
+  std::deque<int> tiles;
+};
+
+struct RenderPool
+{
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::vector<TileQueue> queues;
+  int frame;
+  int busy;
+  //the pass being traced
+  int step;
+  bool refine;
+  int generation;
+  RenderPool(int n) : queues(n), frame(0), busy(0), step(1), refine(false), generation(0) {}
+};
+
+//allocated once and never freed so workers can be left waiting at exit
+RenderPool *pool=NULL;
+
+std::atomic<int> renderGeneration(0);
+
+//tiles finished since the display last looked, only collected while a
+//window shows the frame as it is traced. Workers copy a finished tile into
+//displayBuffer (bottom row first) so the display never reads pixels a later
+//pass is writing.
+bool collect_tiles=false;
+std::mutex finishedLock;
+std::vector<int> finishedTiles;
+std::vector<unsigned char> displayBuffer;
+bool frameFinished=false;
+
+//pixel range [x0,x1) x [y0,y1) of a tile, y counts rows from the bottom
+void tileBounds(int tile, int *x0, int *y0, int *x1, int *y1)
+{
+    int tilesX = (width+TILE_SIZE-1)/TILE_SIZE;
+    *x0 = (tile%tilesX)*TILE_SIZE;
+    *y0 = (tile/tilesX)*TILE_SIZE;
+    *x1 = std::min(*x0+TILE_SIZE, width);
+    *y1 = std::min(*y0+TILE_SIZE, height);
+}
+
+//Traces one pass of a tile. With refine set, the pixels a pass of twice the
+//step already traced are skipped.
+void renderTile(int tile, int step, bool refine)
+{
+    int x0, y0, x1, y1;
+    tileBounds(tile, &x0, &y0, &x1, &y1);
+    for(int i=y0;i<y1;i+=step)
+    {
+        if(refine && i%(2*step) == 0)
+            traceRow(i,x0+step,x1,2*step,step);
+        else
+            traceRow(i,x0,x1,step,step);
+    }
+}
+
+void publishTile(int tile)
+{
+    int x0, y0, x1, y1;
+    tileBounds(tile, &x0, &y0, &x1, &y1);
+    std::lock_guard<std::mutex> guard(finishedLock);
+    for(int y=y0;y<y1;y++)
+        memcpy(&displayBuffer[3*(y*width+x0)], &buffer[3*((height-y-1)*width+x0)], 3*(x1-x0));
+    finishedTiles.push_back(tile);
+}
+
+//own queue from the front, other queues from the back
+bool nextTile(int id, int *tile)
+{
+    int n = pool->queues.size();
+    for(int k=0;k<n;k++)
+    {
+        TileQueue &q = pool->queues[(id+k)%n];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if(q.tiles.empty())
+            continue;
+        if(k == 0)
+        {
+            *tile = q.tiles.front();
+            q.tiles.pop_front();
+        }
+        else
+        {
+            *tile = q.tiles.back();
+            q.tiles.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void renderWorker(int id)
+{
+    int seen=0;
+    std::unique_lock<std::mutex> guard(pool->lock);
+    while(true)
+    {
+        while(pool->frame == seen)
+            pool->wake.wait(guard);
+        seen = pool->frame;
+        int step = pool->step, generation = pool->generation;
+        bool refine = pool->refine;
+        guard.unlock();
+
+        //a cancelled pass still drains its queues
+        int tile;
+        while(nextTile(id,&tile))
+        {
+            if(renderGeneration != generation)
+                continue;
+            renderTile(tile,step,refine);
+            flushStats();
+            if(collect_tiles)
+                publishTile(tile);
+        }
+
+        guard.lock();
+        if(--pool->busy == 0)
+            pool->done.notify_all();
+    }
+}
+
+void startRenderThreads()
+{
+    resolveThreads();
+    pool = new RenderPool(num_threads);
+    for(int i=0;i<num_threads;i++)
+        std::thread(renderWorker,i).detach();
+    printf("Rendering with %d threads%s\n",num_threads,use_packets ? ", " SIMD_NAME " ray packets" : "");
+}
+
+//Deals the tiles of one pass out to the workers and blocks until the pass
+//is finished or cancelled
+void renderFrame(int step, bool refine, int generation)
+{
+    if(!pool)
+        startRenderThreads();
+    int tilesX = (width+TILE_SIZE-1)/TILE_SIZE;
+    int tilesY = (height+TILE_SIZE-1)/TILE_SIZE;
+    int numTiles = tilesX*tilesY;
+    for(int k=0;k<num_threads;k++)
+    {
+        TileQueue &q = pool->queues[k];
+        std::lock_guard<std::mutex> guard(q.lock);
+        for(int tile=k*numTiles/num_threads;tile<(k+1)*numTiles/num_threads;tile++)
+            q.tiles.push_back(tile);
+    }
+
+    std::unique_lock<std::mutex> guard(pool->lock);
+    pool->busy = num_threads;
+    pool->step = step;
+    pool->refine = refine;
+    pool->generation = generation;
+    pool->frame++;
+    pool->wake.notify_all();
+    while(pool->busy > 0)
+        pool->done.wait(guard);
+}
+
+//Traces the whole frame into buffer, no GL involved
+void render_scene()
+{
+    ScopedTimer timer(PHASE_RENDER);
+    setCameraBasis();
+    getImageBorders();
+    buffer.assign(3*width*height,0);
+    renderFrame(1,false,renderGeneration);
+    printf("Done!\n"); fflush(stdout);
+}
+
+//Traces the frame coarse to fine, returns false as soon as generation is
+//no longer the current one
+bool render_progressive(int generation)
+{
+    ScopedTimer timer(PHASE_RENDER);
+    setCameraBasis();
+    getImageBorders();
+    buffer.resize(3*width*height);
+    for(int step=PREVIEW_STEP;step>=1;step/=2)
+    {
+        if(renderGeneration != generation)
+            return false;
+        renderFrame(step,step < PREVIEW_STEP,generation);
+    }
+    if(renderGeneration != generation)
+        return false;
+    printf("Done!\n"); fflush(stdout);
+    return true;
+}
+
+void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b)
+{
+  unsigned char *p = &buffer[3*((height-y-1)*width+x)];
+  p[0]=r;
+  p[1]=g;
+  p[2]=b;
+}
+
+//called from the render threads, the display uploads finished tiles from
+//the frame buffer
+void plot_pixel(int x,int y,unsigned char r,unsigned char g, unsigned char b)
+{
+  plot_pixel_jpeg(x,y,r,g,b);
+}
+
+//fills the block x block square above and right of (x,y), clipped to the frame
+void plot_block(int x,int y,int block,const double color[3])
+{
+  unsigned char r = color[0]*255, g = color[1]*255, b = color[2]*255;
+  for(int i=y;i<std::min(y+block,height);i++)
+    for(int j=x;j<std::min(x+block,width);j++)
+      plot_pixel(j,i,r,g,b);
+}
+
+void save_jpg()
+{
+  ScopedTimer timer(PHASE_SAVE);
+  Pic *in = NULL;
+
+  in = pic_alloc(width, height, 3, NULL);
+  printf("Saving JPEG file: %s\n", filename);
+
+  memcpy(in->pix,&buffer[0],3*width*height);
+  //a .ppm name keeps the frame lossless, e.g. for --compare references
+  const char *suffix = strrchr(filename,'.');
+  int saved = suffix && strcmp(suffix,".ppm") == 0 ? ppm_write(filename, in) : jpeg_write(filename, in);
+  if (saved)
+    printf("File saved Successfully\n");
+  else
+    printf("Error in Saving\n");
+
+  pic_free(in);      
+
+}
+
+//GOLDEN IMAGE COMPARISON
+//--compare checks the rendered frame against a reference render. A pixel
+//fails when any channel is more than compare_tolerance off, the frame fails
+//when more than compare_max_bad of its pixels fail or its PSNR is below
+//compare_min_psnr. A jpeg reference is compared with the frame after the
+//same jpeg round trip, so the compression error cancels out, a ppm reference
+//can be held to --tolerance 0.
+char *compare_file=NULL;
+int compare_tolerance=16;
+double compare_max_bad=0.001;
+double compare_min_psnr=35.0;
+
+//reads a jpeg or ppm by its first bytes, pic_read() does not recognise the
+//JFIF files jpeg_write() produces
+Pic *read_reference(char *file, bool *isJpeg)
+{
+  unsigned char magic[4] = {0,0,0,0};
+  FILE *in = fopen(file,"rb");
+  if(!in)
+    return NULL;
+  size_t got = fread(magic,1,sizeof(magic),in);
+  fclose(in);
+  *isJpeg = got >= 2 && magic[0] == 0xff && magic[1] == 0xd8;
+  if(got >= 2 && magic[0] == 'P' && (magic[1] == '3' || magic[1] == '6'))
+    return ppm_read(file,NULL);
+  if(*isJpeg)
+    return jpeg_read(file,NULL);
+  if(got == 4 && magic[0] == 0x89 && magic[1] == 'P' && magic[2] == 'N' && magic[3] == 'G')
+    printf("%s is a PNG, references must be jpeg or ppm\n",file);
+  return NULL;
+}
+
+//true when the frame in buffer matches the reference
+bool compare_frame(char *reference)
+{
+  bool isJpeg=false;
+  Pic *ref = read_reference(reference,&isJpeg);
+  if(!ref)
+  {
+    printf("compare: cannot read %s\n",reference);
+    return false;
+  }
+  if(ref->nx != width || ref->ny != height)
+  {
+    printf("compare: %s is %dx%d, the frame is %dx%d\n",reference,ref->nx,ref->ny,width,height);
+    pic_free(ref);
+    return false;
+  }
+
+  const unsigned char *frame = &buffer[0];
+  Pic *encoded = NULL;
+  if(isJpeg)
+  {
+    char temp[] = "/tmp/assign3-compare-XXXXXX";
+    int fd = mkstemp(temp);
+    if(fd < 0)
+    {
+      printf("compare: cannot create a temporary file\n");
+      pic_free(ref);
+      return false;
+    }
+    close(fd);
+    Pic *in = pic_alloc(width, height, 3, NULL);
+    memcpy(in->pix,&buffer[0],3*width*height);
+    if(jpeg_write(temp, in))
+      encoded = jpeg_read(temp, NULL);
+    pic_free(in);
+    unlink(temp);
+    if(!encoded || encoded->bpp != 3)
+    {
+      printf("compare: jpeg round trip of the frame failed\n");
+      if(encoded)
+        pic_free(encoded);
+      pic_free(ref);
+      return false;
+    }
+    frame = encoded->pix;
+  }
+
+  double squared=0;
+  long bad=0;
+  int worst=0, worstX=0, worstY=0;
+  for(int y=0;y<height;y++)
+    for(int x=0;x<width;x++)
+    {
+      const unsigned char *p = &frame[3*(y*width+x)];
+      int pixelDiff=0;
+      for(int c=0;c<3;c++)
+      {
+        int diff = abs((int)p[c]-(int)PIC_PIXEL(ref,x,y,ref->bpp >= 3 ? c : 0));
+        squared += diff*diff;
+        pixelDiff = std::max(pixelDiff,diff);
+      }
+      if(pixelDiff > compare_tolerance)
+        bad++;
+      if(pixelDiff > worst)
+      {
+        worst = pixelDiff;
+        worstX = x;
+        worstY = y;
+      }
+    }
+  pic_free(ref);
+  if(encoded)
+    pic_free(encoded);
+
+  double mse = squared/(3.0*width*height);
+  double psnr = mse > 0 ? 10.0*log10(255.0*255.0/mse) : INFINITY;
+  double badFraction = (double)bad/((double)width*height);
+  bool pass = psnr >= compare_min_psnr && badFraction <= compare_max_bad;
+  printf("compare %s: %s, PSNR %.2f dB, %ld pixels off by more than %d (%.4f%%), worst %d at (%d,%d)\n",
+         reference,pass ? "PASS" : "FAIL",psnr,bad,compare_tolerance,100.0*badFraction,worst,worstX,worstY);
+  return pass;
+}
+
+//SCENE PARSER
+//The scene file is mmapped and tokens are read in place, numbers go through
+//parse_number() instead of scanf. Values are only echoed with --verbose.
+struct SceneReader
+{
+  const char *cur;
+  const char *end;
+};
+
+bool verbose=false;
+
+//next whitespace separated token, not terminated, length in *len
+const char *parse_token(SceneReader *r, int *len)
+{
+  while(r->cur < r->end && (*r->cur == ' ' || *r->cur == '\n' || *r->cur == '\r' || *r->cur == '\t'))
+    r->cur++;
+  const char *start = r->cur;
+  while(r->cur < r->end && !(*r->cur == ' ' || *r->cur == '\n' || *r->cur == '\r' || *r->cur == '\t'))
+    r->cur++;
+  *len = r->cur-start;
+  return start;
+}
+
+void parse_check(const char *expected,SceneReader *r)
+{
+  int len;
+  const char *found = parse_token(r,&len);
+  if((int)strlen(expected) != len || strncasecmp(expected,found,len))
+    {
+      printf("Expected '%s ' found '%.*s '\n",expected,len,found);
+      printf("Parse error, abnormal abortion\n");
+      exit(0);
+    }
+
+}
+
+//powers of ten that are exact in a double
+static const double exactPow10[] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+                                    1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+
+//[sign] digits [. digits] [e [sign] digits], falls back to strtod for
+//anything longer or stranger than that. The shortcut is only taken when the
+//digits fit the 53 bit mantissa and the power of ten is exact, then the one
+//multiply or divide rounds exactly like strtod.
+double parse_number(SceneReader *r)
+{
+  int len;
+  const char *p = parse_token(r,&len);
+  const char *end = p+len;
+  const char *start = p;
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+'))
+    negative = (*p++ == '-');
+
+  unsigned long long mantissa = 0;
+  int digits = 0, exponent = 0;
+  for(;p < end && *p >= '0' && *p <= '9';p++)
+    {
+      mantissa = mantissa*10 + (*p-'0');
+      digits++;
+    }
+  if(p < end && *p == '.')
+    for(p++;p < end && *p >= '0' && *p <= '9';p++)
+      {
+	mantissa = mantissa*10 + (*p-'0');
+	digits++;
+	exponent--;
+      }
+  if(p < end && (*p == 'e' || *p == 'E'))
+    {
+      p++;
+      bool negativeExp = false;
+      if(p < end && (*p == '-' || *p == '+'))
+	negativeExp = (*p++ == '-');
+      int e = 0;
+      for(;p < end && *p >= '0' && *p <= '9' && e < 10000;p++)
+	e = e*10 + (*p-'0');
+      exponent += negativeExp ? -e : e;
+    }
+
+  if(p != end || digits == 0 || digits > 19 || mantissa > (1ULL<<53) || exponent < -22 || exponent > 22)
+    {
+      char str[100];
+      if(len >= (int)sizeof(str))
+	len = sizeof(str)-1;
+      memcpy(str,start,len);
+      str[len] = 0;
+      char *parsed;
+      double value = strtod(str,&parsed);
+      if(parsed == str || *parsed)
+	{
+	  printf("Expected a number, found '%s '\n",str);
+	  printf("Parse error, abnormal abortion\n");
+	  exit(0);
+	}
+      return value;
+    }
+  double value = (double)mantissa;
+  value = exponent < 0 ? value/exactPow10[-exponent] : value*exactPow10[exponent];
+  return negative ? -value : value;
+}
+
+void parse_doubles(SceneReader *r, const char *check, double p[3])
+{
+  parse_check(check,r);
+  p[0] = parse_number(r);
+  p[1] = parse_number(r);
+  p[2] = parse_number(r);
+  if(verbose)
+    printf("%s %lf %lf %lf\n",check,p[0],p[1],p[2]);
+}
+
+void parse_rad(SceneReader *r,double *rad)
+{
+  parse_check("rad:",r);
+  *rad = parse_number(r);
+  if(verbose)
+    printf("rad: %f\n",*rad);
+}
+
+void parse_shi(SceneReader *r,double *shi)
+{
+  parse_check("shi:",r);
+  *shi = parse_number(r);
+  if(verbose)
+    printf("shi: %f\n",*shi);
+}
+
+//BINARY SCENES
+//loadScene() also accepts the binary format from bscene.h. Text scenes are
+//hashed and a binary copy is kept in the scene cache, so the next run of
+//the same file only has to map and copy it.
+bool use_scene_cache=true;
+uint64_t sceneHash=0;
+uint64_t sceneSize=0;
+uint64_t sceneMtime=0;
+bool sceneCached=false;		//the last loadScene() came from the cache
+
+//maps a whole file read-only, NULL if it is missing or empty. *mtime gets
+//the modification time in nanoseconds when asked for.
+const char *mapFile(const char *path, size_t *size, uint64_t *mtime=NULL)
+{
+  int fd = open(path,O_RDONLY);
+  struct stat info;
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd,&info) < 0 || info.st_size <= 0)
+    {
+      close(fd);
+      return NULL;
+    }
+  void *data = mmap(NULL,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(data == MAP_FAILED)
+    return NULL;
+  *size = info.st_size;
+  if(mtime)
+#ifdef __APPLE__
+    *mtime = (uint64_t)info.st_mtimespec.tv_sec*1000000000ULL+info.st_mtimespec.tv_nsec;
+#else
+    *mtime = (uint64_t)info.st_mtim.tv_sec*1000000000ULL+info.st_mtim.tv_nsec;
+#endif
+  return (const char *)data;
+}
+
+//MurmurHash64A, eight bytes per step. Every word is mixed on its own before
+//it is folded in and the result is finalized, so a change anywhere in a
+//word reaches all 64 bits of the hash.
+uint64_t hashBytes(const char *data, size_t size)
+{
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  uint64_t hash = 0x9e3779b97f4a7c15ULL^(size*m);
+  size_t i = 0;
+  for(;i+8 <= size;i+=8)
+    {
+      uint64_t word;
+      memcpy(&word,data+i,8);
+      word *= m;
+      word ^= word>>47;
+      word *= m;
+      hash = (hash^word)*m;
+    }
+  if(i < size)
+    {
+      uint64_t tail = 0;
+      for(size_t k=i;k < size;k++)
+	tail |= (uint64_t)(unsigned char)data[k]<<(8*(k-i));
+      hash = (hash^tail)*m;
+    }
+  hash ^= hash>>47;
+  hash *= m;
+  hash ^= hash>>47;
+  return hash;
+}
+
+//$RT_SCENE_CACHE, else $XDG_CACHE_HOME/assign3, else ~/.cache/assign3
+bool sceneCacheDir(char *dir, size_t size)
+{
+  const char *env;
+  if((env = getenv("RT_SCENE_CACHE")))
+    snprintf(dir,size,"%s",env);
+  else if((env = getenv("XDG_CACHE_HOME")))
+    {
+      mkdir(env,0755);
+      snprintf(dir,size,"%s/assign3",env);
+    }
+  else if((env = getenv("HOME")))
+    {
+      snprintf(dir,size,"%s/.cache",env);
+      mkdir(dir,0755);
+      snprintf(dir,size,"%s/.cache/assign3",env);
+    }
+  else
+    return false;
+  mkdir(dir,0755);
+  return true;
+}
+
+bool sceneCachePath(uint64_t hash, char *path, size_t size)
+{
+  char dir[1024];
+  if(!sceneCacheDir(dir,sizeof(dir)))
+    return false;
+  snprintf(path,size,"%s/%016llx.bscene",dir,(unsigned long long)hash);
+  return true;
+}
+
+//Entries are keyed on the text, so every edit of a scene would leave one
+//behind. <hash of the source path>.last names the entry last written for
+//that path, and writing a new one deletes the entry it replaces.
+void replaceSceneCacheEntry(const char *source, uint64_t hash)
+{
+  char dir[1024], resolved[PATH_MAX];
+  if(!sceneCacheDir(dir,sizeof(dir)))
+    return;
+  const char *key = realpath(source,resolved) ? resolved : source;
+  char marker[1100];
+  snprintf(marker,sizeof(marker),"%s/%016llx.last",dir,(unsigned long long)hashBytes(key,strlen(key)));
+  FILE *file = fopen(marker,"r");
+  if(file)
+    {
+      unsigned long long previous;
+      char previousPath[1100];
+      if(fscanf(file,"%llx",&previous) == 1 && previous != hash &&
+         sceneCachePath(previous,previousPath,sizeof(previousPath)))
+	unlink(previousPath);
+      fclose(file);
+    }
+  char temp[1200];
+  snprintf(temp,sizeof(temp),"%s.%d.tmp",marker,(int)getpid());
+  file = fopen(temp,"w");
+  if(!file)
+    return;
+  bool ok = fprintf(file,"%016llx\n",(unsigned long long)hash) > 0;
+  ok = (fclose(file) == 0) && ok;
+  if(!ok || rename(temp,marker) != 0)
+    unlink(temp);
+}
+
+bool isBinaryScene(const char *data, size_t size)
+{
+  return size >= sizeof(BSceneHeader) && memcmp(data,BSCENE_MAGIC,8) == 0;
+}
+
+//Fills the scene from a mapped binary file. A non-zero hash means the file
+//is a cache entry and must belong to that exact text scene: same hash, size
+//and modification time.
+bool loadBinaryScene(const char *data, size_t size, uint64_t hash, uint64_t sourceSize, uint64_t sourceMtime)
+{
+  if(!isBinaryScene(data,size))
+    return false;
+  BSceneHeader header;
+  memcpy(&header,data,sizeof(header));
+  if(header.version != BSCENE_VERSION || header.headerSize != sizeof(BSceneHeader))
+    return false;
+  if(hash && (header.sourceHash != hash || header.sourceSize != sourceSize || header.sourceMtime != sourceMtime))
+    return false;
+
+  //the counts must fit the renderer's ints, the array sizes are worked out
+  //in 64 bits where 32 bit counts cannot wrap, and every array has to lie
+  //between the header and the end of the file
+  if(header.numTriangles > INT_MAX || header.numSpheres > INT_MAX || header.numLights > INT_MAX)
+    return false;
+  uint64_t nt = header.numTriangles, ns = header.numSpheres, nl = header.numLights;
+  uint64_t bytes[BSCENE_NUM_ARRAYS] = {nt*9*sizeof(double),nt*9*sizeof(double),nt*9*sizeof(double),
+                                       nt*9*sizeof(double),nt*3*sizeof(double),
+                                       ns*sizeof(BSceneSphere),nl*sizeof(BSceneLight)};
+  for(int k=0;k<BSCENE_NUM_ARRAYS;k++)
+    if(header.offset[k] < sizeof(header) || header.offset[k] > size || bytes[k] > size-header.offset[k] ||
+       header.offset[k]%sizeof(double))
+      return false;
+
+  const double *position = (const double *)(data+header.offset[BSCENE_TRI_POSITION]);
+  const double *normal = (const double *)(data+header.offset[BSCENE_TRI_NORMAL]);
+  const double *diffuse = (const double *)(data+header.offset[BSCENE_TRI_DIFFUSE]);
+  const double *specular = (const double *)(data+header.offset[BSCENE_TRI_SPECULAR]);
+  const double *shininess = (const double *)(data+header.offset[BSCENE_TRI_SHININESS]);
+  const BSceneSphere *sphere = (const BSceneSphere *)(data+header.offset[BSCENE_SPHERES]);
+  const BSceneLight *light = (const BSceneLight *)(data+header.offset[BSCENE_LIGHTS]);
+
+  memcpy(ambient_light,header.ambient,sizeof(ambient_light));
+  triangles.resize(nt);
+  for(uint64_t i=0;i<nt;i++)
+    for(int j=0;j<3;j++)
+      {
+	Vertex &v = triangles[i].v[j];
+	memcpy(v.position,position+9*i+3*j,3*sizeof(double));
+	memcpy(v.normal,normal+9*i+3*j,3*sizeof(double));
+	memcpy(v.color_diffuse,diffuse+9*i+3*j,3*sizeof(double));
+	memcpy(v.color_specular,specular+9*i+3*j,3*sizeof(double));
+	v.shininess = shininess[3*i+j];
+      }
+  spheres.resize(ns);
+  for(uint64_t i=0;i<ns;i++)
+    {
+      memcpy(spheres[i].position,sphere[i].position,3*sizeof(double));
+      spheres[i].radius = sphere[i].radius;
+      memcpy(spheres[i].color_diffuse,sphere[i].color_diffuse,3*sizeof(double));
+      memcpy(spheres[i].color_specular,sphere[i].color_specular,3*sizeof(double));
+      spheres[i].shininess = sphere[i].shininess;
+    }
+  lights.resize(nl);
+  for(uint64_t i=0;i<nl;i++)
+    {
+      memcpy(lights[i].position,light[i].position,3*sizeof(double));
+      memcpy(lights[i].color,light[i].color,3*sizeof(double));
+    }
+  num_triangles = nt;
+  num_spheres = ns;
+  num_lights = nl;
+  return true;
+}
+
+//Writes the loaded scene in the binary format. Goes through a temporary
+//file so concurrent renders never see a half written cache entry.
+bool writeBinaryScene(const char *path, uint64_t hash, uint64_t sourceSize, uint64_t sourceMtime)
+{
+  BSceneHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,BSCENE_MAGIC,8);
+  header.version = BSCENE_VERSION;
+  header.headerSize = sizeof(BSceneHeader);
+  header.sourceHash = hash;
+  header.sourceSize = sourceSize;
+  header.sourceMtime = sourceMtime;
+  header.numTriangles = num_triangles;
+  header.numSpheres = num_spheres;
+  header.numLights = num_lights;
+  memcpy(header.ambient,ambient_light,sizeof(header.ambient));
+
+  uint64_t nt = num_triangles;
+  uint64_t bytes[BSCENE_NUM_ARRAYS] = {nt*9*sizeof(double),nt*9*sizeof(double),nt*9*sizeof(double),
+                                       nt*9*sizeof(double),nt*3*sizeof(double),
+                                       num_spheres*sizeof(BSceneSphere),num_lights*sizeof(BSceneLight)};
+  uint64_t offset = sizeof(header);
+  for(int k=0;k<BSCENE_NUM_ARRAYS;k++)
+    {
+      offset = (offset+BSCENE_ALIGN-1)/BSCENE_ALIGN*BSCENE_ALIGN;
+      header.offset[k] = offset;
+      offset += bytes[k];
+    }
+
+  std::vector<char> data(offset,0);
+  memcpy(&data[0],&header,sizeof(header));
+  double *position = (double *)&data[header.offset[BSCENE_TRI_POSITION]];
+  double *normal = (double *)&data[header.offset[BSCENE_TRI_NORMAL]];
+  double *diffuse = (double *)&data[header.offset[BSCENE_TRI_DIFFUSE]];
+  double *specular = (double *)&data[header.offset[BSCENE_TRI_SPECULAR]];
+  double *shininess = (double *)&data[header.offset[BSCENE_TRI_SHININESS]];
+  for(size_t i=0;i<nt;i++)
+    for(int j=0;j<3;j++)
+      {
+	const Vertex &v = triangles[i].v[j];
+	memcpy(position+9*i+3*j,v.position,3*sizeof(double));
+	memcpy(normal+9*i+3*j,v.normal,3*sizeof(double));
+	memcpy(diffuse+9*i+3*j,v.color_diffuse,3*sizeof(double));
+	memcpy(specular+9*i+3*j,v.color_specular,3*sizeof(double));
+	shininess[3*i+j] = v.shininess;
+      }
+  for(size_t i=0;i<(size_t)num_spheres;i++)
+    {
+      BSceneSphere sphere;
+      memcpy(sphere.position,spheres[i].position,3*sizeof(double));
+      sphere.radius = spheres[i].radius;
+      memcpy(sphere.color_diffuse,spheres[i].color_diffuse,3*sizeof(double));
+      memcpy(sphere.color_specular,spheres[i].color_specular,3*sizeof(double));
+      sphere.shininess = spheres[i].shininess;
+      memcpy(&data[header.offset[BSCENE_SPHERES]+i*sizeof(BSceneSphere)],&sphere,sizeof(sphere));
+    }
+  for(size_t i=0;i<(size_t)num_lights;i++)
+    {
+      BSceneLight light;
+      memcpy(light.position,lights[i].position,3*sizeof(double));
+      memcpy(light.color,lights[i].color,3*sizeof(double));
+      memcpy(&data[header.offset[BSCENE_LIGHTS]+i*sizeof(BSceneLight)],&light,sizeof(light));
+    }
+
+  char temp[1100];
+  snprintf(temp,sizeof(temp),"%s.%d.tmp",path,(int)getpid());
+  FILE *file = fopen(temp,"wb");
+  if(!file)
+    return false;
+  bool ok = fwrite(&data[0],1,data.size(),file) == data.size();
+  ok = (fclose(file) == 0) && ok;
+  if(ok)
+    ok = rename(temp,path) == 0;
+  if(!ok)
+    remove(temp);
+  return ok;
+}
+
+//Text scene parser, the reader covers the whole mapped file
+void parseScene(SceneReader *file)
+{
+  int number_of_objects;
+  int i;
+  Triangle t;
+  Sphere s;
+  Light l;
+  number_of_objects = (int)parse_number(file);
+  //a reload replaces the previous scene
+  triangles.clear();
+  spheres.clear();
+  lights.clear();
+  num_triangles = num_spheres = num_lights = 0;
+
+  printf("number of objects: %i\n",number_of_objects);
+
+  parse_doubles(file,"amb:",ambient_light);
+
+  for(i=0;i < number_of_objects;i++)
+    {
+      int len;
+      const char *type = parse_token(file,&len);
+      if(verbose)
+	printf("%.*s\n",len,type);
+      if(len == 8 && strncasecmp(type,"triangle",len)==0)
+	{
+
+	  if(verbose)
+	    printf("found triangle\n");
+	  int j;
+
+	  for(j=0;j < 3;j++)
+	    {
+	      parse_doubles(file,"pos:",t.v[j].position);
+	      parse_doubles(file,"nor:",t.v[j].normal);
+	      parse_doubles(file,"dif:",t.v[j].color_diffuse);
+	      parse_doubles(file,"spe:",t.v[j].color_specular);
+	      parse_shi(file,&t.v[j].shininess);
+	    }
+
+	  triangles.push_back(t);
+	  num_triangles++;
+	}
+      else if(len == 6 && strncasecmp(type,"sphere",len)==0)
+	{
+	  if(verbose)
+	    printf("found sphere\n");
+
+	  parse_doubles(file,"pos:",s.position);
+	  parse_rad(file,&s.radius);
+	  parse_doubles(file,"dif:",s.color_diffuse);
+	  parse_doubles(file,"spe:",s.color_specular);
+	  parse_shi(file,&s.shininess);
+
+	  spheres.push_back(s);
+	  num_spheres++;
+	}
+      else if(len == 5 && strncasecmp(type,"light",len)==0)
+	{
+	  if(verbose)
+	    printf("found light\n");
+	  parse_doubles(file,"pos:",l.position);
+	  parse_doubles(file,"col:",l.color);
+
+	  lights.push_back(l);
+	  num_lights++;
+	}
+      else
+	{
+	  printf("unknown type in scene description:\n%.*s\n",len,type);
+	  exit(0);
+	}
+    }
+}
+
+int loadScene(char *argv)
+{
+  ScopedTimer timer(PHASE_LOAD);
+  size_t size;
+  uint64_t mtime;
+  const char *data = mapFile(argv,&size,&mtime);
+  if(!data)
+    {
+      printf("Could not read scene file %s\n",argv);
+      exit(0);
+    }
+
+  sceneCached = false;
+  if(isBinaryScene(data,size))
+    {
+      if(!loadBinaryScene(data,size,0,0,0))
+	{
+	  printf("Unsupported or damaged binary scene %s\n",argv);
+	  exit(0);
+	}
+      printf("Loaded binary scene %s\n",argv);
+    }
+  else
+    {
+      sceneHash = hashBytes(data,size);
+      sceneSize = size;
+      sceneMtime = mtime;
+      char cachePath[1100];
+      bool cached = false;
+      bool cacheable = use_scene_cache && sceneCachePath(sceneHash,cachePath,sizeof(cachePath));
+      if(cacheable)
+	{
+	  size_t cacheSize;
+	  const char *cache = mapFile(cachePath,&cacheSize);
+	  if(cache)
+	    {
+	      cached = loadBinaryScene(cache,cacheSize,sceneHash,sceneSize,sceneMtime);
+	      munmap((void *)cache,cacheSize);
+	    }
+	}
+      sceneCached = cached;
+      if(cached)
+	printf("Loaded cached scene %s\n",cachePath);
+      else
+	{
+	  SceneReader reader = {data,data+size};
+	  parseScene(&reader);
+	  if(cacheable)
+	    {
+	      if(writeBinaryScene(cachePath,sceneHash,sceneSize,sceneMtime))
+		replaceSceneCacheEntry(argv,sceneHash);
+	      else
+		printf("Could not write scene cache %s\n",cachePath);
+	    }
+	}
+    }
+  munmap((void *)data,size);
+  printf("%d triangles, %d spheres, %d lights\n",num_triangles,num_spheres,num_lights);
+  return 0;
+}
+
+#ifndef NO_GL
+//DISPLAY
+//The frame is traced on its own thread while GLUT keeps running. Finished
+//tiles are copied into a pixel buffer object, uploaded to one texture with
+//glTexSubImage2D and the texture is drawn as a single quad.
+GLuint frameTexture=0;
+GLuint framePBO=0;
+char *scene_file=NULL;
+
+//the window's camera belongs to the GL thread, restartRender() hands a copy
+//to the render thread which applies it before the first pass
+struct Camera
+{
+  double eye[3];
+  double yaw, pitch;
+  double fov;
+};
+Camera view;
+
+//set by restartRender() for the render thread
+std::condition_variable restartWake;
+bool reload_requested=false;
+Camera pendingView;
+
+//distance a key press moves the camera, scaled to the scene
+double move_step=1.0;
+
+//The render thread: traces a generation progressively and waits for the
+//next one. Scene reloads happen here, between passes, when no worker runs.
+void renderAsync()
+{
+  int generation = 0;
+  while(true)
+  {
+    bool reload;
+    Camera camera;
+    {
+      std::unique_lock<std::mutex> guard(finishedLock);
+      while(renderGeneration == generation)
+        restartWake.wait(guard);
+      generation = renderGeneration;
+      reload = reload_requested;
+      reload_requested = false;
+      camera = pendingView;
+    }
+    if(reload)
+    {
+      loadScene(scene_file);
+      buildBVH();
+    }
+    memcpy(origin,camera.eye,sizeof(origin));
+    camYaw = camera.yaw;
+    camPitch = camera.pitch;
+    fov = camera.fov;
+    if(render_progressive(generation))
+    {
+      std::lock_guard<std::mutex> guard(finishedLock);
+      if(generation == renderGeneration)
+        frameFinished = true;
+    }
+  }
+}
+
+void idle();
+
+//Cancels the frame being traced and starts over from the coarsest pass
+void restartRender(bool reload)
+{
+  {
+    std::lock_guard<std::mutex> guard(finishedLock);
+    renderGeneration++;
+    reload_requested |= reload;
+    pendingView = view;
+    frameFinished = false;
+  }
+  restartWake.notify_one();
+  glutIdleFunc(idle);
+}
+
+//Uploads the tiles finished since the last call, returns false when there
+//were none. *finished tells whether the whole frame is on the texture now.
+bool uploadTiles(bool *finished)
+{
+  std::vector<int> tiles;
+  {
+    std::lock_guard<std::mutex> guard(finishedLock);
+    tiles.swap(finishedTiles);
+    *finished = frameFinished;
+  }
+  if(tiles.empty())
+    return false;
+
+  //the PBO holds the frame bottom row first, like the texture
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, framePBO);
+  unsigned char *dst = (unsigned char *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  if(!dst)
+  {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> guard(finishedLock);
+    for(size_t k=0;k<tiles.size();k++)
+    {
+      int x0, y0, x1, y1;
+      tileBounds(tiles[k], &x0, &y0, &x1, &y1);
+      for(int y=y0;y<y1;y++)
+        memcpy(dst+3*(y*width+x0), &displayBuffer[3*(y*width+x0)], 3*(x1-x0));
+    }
+  }
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+  glBindTexture(GL_TEXTURE_2D, frameTexture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+  for(size_t k=0;k<tiles.size();k++)
+  {
+    int x0, y0, x1, y1;
+    tileBounds(tiles[k], &x0, &y0, &x1, &y1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1-x0, y1-y0, GL_RGB, GL_UNSIGNED_BYTE, (void *)(size_t)(3*(y0*width+x0)));
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  return true;
+}
+
+void display()
+{
+  glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_TEXTURE_2D);
+  glBindTexture(GL_TEXTURE_2D, frameTexture);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0,0); glVertex2i(0,0);
+  glTexCoord2f(1,0); glVertex2i(width,0);
+  glTexCoord2f(1,1); glVertex2i(width,height);
+  glTexCoord2f(0,1); glVertex2i(0,height);
+  glEnd();
+  glDisable(GL_TEXTURE_2D);
+  glutSwapBuffers();
+}
+
+void init()
+{
+  glMatrixMode(GL_PROJECTION);
+  glOrtho(0,width,0,height,1,-1);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  glClearColor(1,1,1,1);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  //white until the tiles come in
+  std::vector<unsigned char> white(3*width*height,255);
+  glPixelStorei(GL_UNPACK_ALIGNMENT,1);
+  glGenTextures(1,&frameTexture);
+  glBindTexture(GL_TEXTURE_2D,frameTexture);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D,0,GL_RGB8,width,height,0,GL_RGB,GL_UNSIGNED_BYTE,&white[0]);
+
+  glGenBuffers(1,&framePBO);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER,framePBO);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER,3*width*height,NULL,GL_STREAM_DRAW);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
+  displayBuffer.assign(3*width*height,0);
+}
+
+//CAMERA CONTROLS
+//w/s/a/d move along the view, e/q move up and down, the arrow keys or a
+//drag with the left button turn, +/- zoom and r reloads the scene file.
+//Every change prints the options that render the same view headless.
+void moveCamera()
+{
+  if(view.pitch > 89.0)
+    view.pitch = 89.0;
+  else if(view.pitch < -89.0)
+    view.pitch = -89.0;
+  if(view.fov < 5.0)
+    view.fov = 5.0;
+  else if(view.fov > 170.0)
+    view.fov = 170.0;
+  printf("camera: --eye %g %g %g --yaw %g --pitch %g --fov %g\n",view.eye[0],view.eye[1],view.eye[2],view.yaw,view.pitch,view.fov);
+  fflush(stdout);
+  restartRender(false);
+}
+
+void keyboard(unsigned char key, int, int)
+{
+  double forward[3], right[3];
+  cameraAxes(view.yaw,view.pitch,forward,right);
+  double *axis = NULL;
+  double amount = move_step;
+  switch(key)
+  {
+  case 'w': case 'W': axis = forward; break;
+  case 's': case 'S': axis = forward; amount = -move_step; break;
+  case 'd': case 'D': axis = right; break;
+  case 'a': case 'A': axis = right; amount = -move_step; break;
+  case 'e': case 'E': view.eye[1] += move_step; break;
+  case 'q': case 'Q': view.eye[1] -= move_step; break;
+  case '+': case '=': view.fov -= 5.0; break;
+  case '-': case '_': view.fov += 5.0; break;
+  //r reloads the scene file, e.g. after editing its lights
+  case 'r': case 'R': restartRender(true); return;
+  default: return;
+  }
+  if(axis)
+    for(int a=0;a<3;a++)
+      view.eye[a] += amount*axis[a];
+  moveCamera();
+}
+
+void special(int key, int, int)
+{
+  switch(key)
+  {
+  case GLUT_KEY_LEFT: view.yaw += 5.0; break;
+  case GLUT_KEY_RIGHT: view.yaw -= 5.0; break;
+  case GLUT_KEY_UP: view.pitch += 5.0; break;
+  case GLUT_KEY_DOWN: view.pitch -= 5.0; break;
+  default: return;
+  }
+  moveCamera();
+}
+
+int drag_x, drag_y;
+bool dragging=false;
+
+void mouse(int button, int state, int x, int y)
+{
+  if(button != GLUT_LEFT_BUTTON)
+    return;
+  dragging = (state == GLUT_DOWN);
+  drag_x = x;
+  drag_y = y;
+}
+
+void motion(int x, int y)
+{
+  if(!dragging || (x == drag_x && y == drag_y))
+    return;
+  //a fifth of a degree per pixel, dragging right turns right
+  view.yaw -= 0.2*(x-drag_x);
+  view.pitch -= 0.2*(y-drag_y);
+  drag_x = x;
+  drag_y = y;
+  moveCamera();
+}
+
+void idle()
+{
+  //start the render thread once, the window keeps refreshing while tiles
+  //come in
+  static bool started=false;
+  if(!started)
+  {
+      started=true;
+      collect_tiles=true;
+      std::thread(renderAsync).detach();
+      restartRender(false);
+  }
+
+  bool finished;
+  if(uploadTiles(&finished))
+      glutPostRedisplay();
+  else if(!finished)
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  if(finished)
+  {
+      //every tile is on screen, nothing left to do until the next restart
+      if(mode == MODE_JPEG)
+	save_jpg();
+      reportStats();
+      glutIdleFunc(NULL);
+  }
+}
+#endif
+
+//BENCHMARK
+//--bench N loads, builds and renders every scene given N times and prints
+//one JSON report with the median times, ray rates and the peak memory.
+//Loads served by the scene cache are timed apart from the ones that parse
+//or map the scene file, the first run usually fills the cache.
+double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+}
+
+double median(std::vector<double> v)
+{
+  std::sort(v.begin(),v.end());
+  size_t n = v.size();
+  return (n%2) ? v[n/2] : 0.5*(v[n/2-1]+v[n/2]);
+}
+
+//"key": median, or null when no run was timed
+void printMedian(FILE *out, const char *key, const std::vector<double> &v)
+{
+  if(v.empty())
+    fprintf(out,"      \"%s\": null,\n",key);
+  else
+    fprintf(out,"      \"%s\": %.3f,\n",key,median(v));
+}
+
+int runBenchmark(const std::vector<char *> &scenes, int runs)
+{
+  //progress messages go to stderr so stdout only carries the report
+  fflush(stdout);
+  FILE *report = fdopen(dup(1),"w");
+  dup2(2,1);
+
+  fprintf(report,"{\n  \"simd\": \"%s\",\n  \"packets\": %s,\n  \"accel\": \"%s\",\n",SIMD_NAME,use_packets ? "true" : "false",accelNames[accel]);
+  fprintf(report,"  \"width\": %d,\n  \"height\": %d,\n  \"runs\": %d,\n  \"scenes\": [",width,height,runs);
+  for(size_t s=0;s<scenes.size();s++)
+  {
+    std::vector<double> loadMs, cachedLoadMs, buildMs, renderMs;
+    RayStats rays = RayStats();
+    for(int run=0;run<runs;run++)
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      loadScene(scenes[s]);
+      (sceneCached ? cachedLoadMs : loadMs).push_back(elapsedMs(start));
+
+      start = std::chrono::steady_clock::now();
+      buildBVH();
+      buildMs.push_back(elapsedMs(start));
+
+      RayStats before = snapshotStats();
+      start = std::chrono::steady_clock::now();
+      render_scene();
+      renderMs.push_back(elapsedMs(start));
+      RayStats after = snapshotStats();
+      rays.primaryRays = after.primaryRays-before.primaryRays;
+      rays.shadowRays = after.shadowRays-before.shadowRays;
+      rays.triangleTests = after.triangleTests-before.triangleTests;
+      rays.sphereTests = after.sphereTests-before.sphereTests;
+      rays.nodesVisited = after.nodesVisited-before.nodesVisited;
+    }
+    long primary = rays.primaryRays, shadow = rays.shadowRays;
+    double render = median(renderMs);
+    double seconds = render/1000.0;
+    fprintf(report,"%s\n    {\n      \"scene\": \"%s\",\n",s ? "," : "",scenes[s]);
+    fprintf(report,"      \"triangles\": %d,\n      \"spheres\": %d,\n      \"lights\": %d,\n",num_triangles,num_spheres,num_lights);
+    fprintf(report,"      \"threads\": %d,\n",num_threads);
+    printMedian(report,"load_ms",loadMs);
+    printMedian(report,"load_ms_cached",cachedLoadMs);
+    fprintf(report,"      \"build_ms\": %.3f,\n",median(buildMs));
+    fprintf(report,"      \"render_ms\": %.3f,\n      \"render_ms_min\": %.3f,\n",render,*std::min_element(renderMs.begin(),renderMs.end()));
+    fprintf(report,"      \"primary_rays\": %ld,\n      \"shadow_rays\": %ld,\n",primary,shadow);
+    fprintf(report,"      \"triangle_tests\": %ld,\n      \"sphere_tests\": %ld,\n      \"nodes_visited\": %ld,\n",rays.triangleTests,rays.sphereTests,rays.nodesVisited);
+    fprintf(report,"      \"primary_mrays_per_s\": %.3f,\n      \"shadow_mrays_per_s\": %.3f,\n",primary/seconds/1e6,shadow/seconds/1e6);
+    fprintf(report,"      \"total_mrays_per_s\": %.3f\n    }",(primary+shadow)/seconds/1e6);
+  }
+
+  //the peak of the whole process, so it covers loading, the cache and every
+  //scene benchmarked before the largest one
+  struct rusage usage;
+  getrusage(RUSAGE_SELF,&usage);
+#ifdef __APPLE__
+  long peakKb = usage.ru_maxrss/1024;	//bytes on macOS
+#else
+  long peakKb = usage.ru_maxrss;
+#endif
+  fprintf(report,"\n  ],\n  \"process_peak_rss_kb\": %ld\n}\n",peakKb);
+  fclose(report);
+  return 0;
+}
+
+int main (int argc, char ** argv)
+{
+  //options may appear anywhere, the rest are the scene and jpeg names, or
+  //any number of scenes with --bench
+  std::vector<char *> args;
+  bool usage=false;
+  char *convert=NULL;
+  int bench_runs=0;
+  for(int i=1;i<argc;i++)
+  {
+    if(strcmp(argv[i],"--threads") == 0 && i+1 < argc)
+      num_threads = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--width") == 0 && i+1 < argc)
+      width = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--height") == 0 && i+1 < argc)
+      height = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--fov") == 0 && i+1 < argc)
+      fov = atof(argv[++i]);
+    else if(strcmp(argv[i],"--eye") == 0 && i+3 < argc)
+    {
+      for(int a=0;a<3;a++)
+        origin[a] = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i],"--yaw") == 0 && i+1 < argc)
+      camYaw = atof(argv[++i]);
+    else if(strcmp(argv[i],"--pitch") == 0 && i+1 < argc)
+      camPitch = atof(argv[++i]);
+    else if(strcmp(argv[i],"--headless") == 0)
+      headless = true;
+    else if(strcmp(argv[i],"--verbose") == 0)
+      verbose = true;
+    else if(strcmp(argv[i],"--no-cache") == 0)
+      use_scene_cache = false;
+    else if(strcmp(argv[i],"--no-packets") == 0)
+      use_packets = false;
+    else if(strcmp(argv[i],"--accel") == 0 && i+1 < argc)
+    {
+      i++;
+      accel = -1;
+      for(int k=0;k<(int)(sizeof(accelNames)/sizeof(accelNames[0]));k++)
+        if(strcmp(argv[i],accelNames[k]) == 0)
+          accel = k;
+      if(accel < 0)
+        usage = true;
+    }
+    else if(strcmp(argv[i],"--convert") == 0 && i+1 < argc)
+      convert = argv[++i];
+    else if(strcmp(argv[i],"--bench") == 0 && i+1 < argc)
+      bench_runs = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--stats") == 0)
+      show_stats = true;
+    else if(strcmp(argv[i],"--stats-json") == 0 && i+1 < argc)
+      stats_json = argv[++i];
+    else if(strcmp(argv[i],"--compare") == 0 && i+1 < argc)
+      compare_file = argv[++i];
+    else if(strcmp(argv[i],"--tolerance") == 0 && i+1 < argc)
+      compare_tolerance = atoi(argv[++i]);
+    else if(strcmp(argv[i],"--max-bad") == 0 && i+1 < argc)
+      compare_max_bad = atof(argv[++i]);
+    else if(strcmp(argv[i],"--min-psnr") == 0 && i+1 < argc)
+      compare_min_psnr = atof(argv[++i]);
+    else if(strncmp(argv[i],"--",2) == 0)
+      usage = true;
+    else
+      args.push_back(argv[i]);
+  }
+  int num_args = args.size();
+  if (usage || num_args < 1 || width <= 0 || height <= 0 || fov <= 0 || fov >= 180 || (num_args > 2 && bench_runs <= 0) || (headless && num_args < 2 && !convert && bench_runs <= 0 && !compare_file))
+  {  
+    printf ("usage: %s [--threads N] [--width W] [--height H] [--fov degrees] [--eye x y z]\n       [--yaw degrees] [--pitch degrees] [--headless] [--verbose] [--no-cache] [--no-packets]\n       [--accel bvh2|bvh8|bvh8q|grid] [--stats] [--stats-json out.json] [--convert out.bscene] <scenefile> [jpegname]\n", argv[0]);
+    printf ("       %s [options] --bench N <scenefile>...\n", argv[0]);
+    printf ("       %s [options] --compare ref.jpg|ref.ppm [--tolerance N] [--max-bad fraction]\n       [--min-psnr dB] <scenefile> [jpegname]\n", argv[0]);
+    printf ("       --headless needs a jpegname unless it compares, a .ppm jpegname is saved lossless\n");
+    exit(0);
   }
-  if(argc == 3)
+  //the compressed tree and the grid have no binary BVH for packets to walk
+  if(accel == ACCEL_BVH8Q || accel == ACCEL_GRID)
+    use_packets = false;
+  if(bench_runs > 0)
+    return runBenchmark(args,bench_runs);
+  if(num_args == 2)
     {
       mode = MODE_JPEG;
-      filename = argv[2];
+      filename = args[1];
     }
-  else if(argc == 2)
+  else
     mode = MODE_DISPLAY;
 
+  //write the scene in the binary format and stop
+  if(convert)
+  {
+    loadScene(args[0]);
+    if(!writeBinaryScene(convert,sceneHash,sceneSize,sceneMtime))
+    {
+      printf("Could not write %s\n",convert);
+      exit(1);
+    }
+    printf("Wrote binary scene %s\n",convert);
+    return 0;
+  }
+
+  //a comparison always renders headless and exits 1 on a mismatch
+  if(headless || compare_file)
+  {
+    loadScene(args[0]);
+    buildBVH();
+    render_scene();
+    if(mode == MODE_JPEG)
+      save_jpg();
+    reportStats();
+    if(compare_file && !compare_frame(compare_file))
+      return 1;
+    return 0;
+  }
+
+#ifndef NO_GL
   glutInit(&argc,argv);
-  loadScene(argv[1]);
+  scene_file = args[0];
+  loadScene(args[0]);
+  buildBVH();
+
+  //start from the command line camera, a key press moves 2% of the scene
+  memcpy(view.eye,origin,sizeof(view.eye));
+  view.yaw = camYaw;
+  view.pitch = camPitch;
+  view.fov = fov;
+  if(sceneBounds.bmin[0] <= sceneBounds.bmax[0])
+  {
+    const float *bmin = sceneBounds.bmin, *bmax = sceneBounds.bmax;
+    double diagonal = sqrt((bmax[0]-bmin[0])*(bmax[0]-bmin[0])+(bmax[1]-bmin[1])*(bmax[1]-bmin[1])+(bmax[2]-bmin[2])*(bmax[2]-bmin[2]));
+    if(diagonal > 0)
+      move_step = 0.02*diagonal;
+  }
+  printf("w/s/a/d/e/q move, arrows or left drag turn, +/- zoom, r reloads the scene\n");
 
-  glutInitDisplayMode(GLUT_RGBA | GLUT_SINGLE);
+  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
   glutInitWindowPosition(0,0);
-  glutInitWindowSize(WIDTH,HEIGHT);
-  int window = glutCreateWindow("Ray Tracer");
+  glutInitWindowSize(width,height);
+  glutCreateWindow("Ray Tracer");
   glutDisplayFunc(display);
+  glutKeyboardFunc(keyboard);
+  glutSpecialFunc(special);
+  glutMouseFunc(mouse);
+  glutMotionFunc(motion);
   glutIdleFunc(idle);
   init();
   glutMainLoop();
+#endif
 }
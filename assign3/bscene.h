@@ -0,0 +1,70 @@
+#ifndef BSCENE_H
+#define BSCENE_H
+
+/* binary scene format, a flat dump of a .scene file that loadScene() can
+   map and copy without parsing.
+
+   The file starts with a BSceneHeader. Every array below is stored at the
+   byte offset recorded in the header, aligned to BSCENE_ALIGN:
+
+     triangle positions   numTriangles*3 vertices * 3 doubles
+     triangle normals     numTriangles*3 vertices * 3 doubles
+     triangle diffuse     numTriangles*3 vertices * 3 doubles
+     triangle specular    numTriangles*3 vertices * 3 doubles
+     triangle shininess   numTriangles*3 vertices doubles
+     spheres              numSpheres BSceneSphere
+     lights               numLights BSceneLight
+
+   Files written as a cache of a text scene remember the hash, size and
+   modification time of that text so stale caches are never used.
+
+   Readers must not trust the counts: array sizes are computed in 64 bits
+   and each array must fit between the header and the end of the file
+   before anything is read. */
+
+#include <stdint.h>
+
+#define BSCENE_MAGIC "RTSCENE"		/* 8 bytes with the terminator */
+#define BSCENE_VERSION 1
+#define BSCENE_ALIGN 64
+
+enum {
+    BSCENE_TRI_POSITION,
+    BSCENE_TRI_NORMAL,
+    BSCENE_TRI_DIFFUSE,
+    BSCENE_TRI_SPECULAR,
+    BSCENE_TRI_SHININESS,
+    BSCENE_SPHERES,
+    BSCENE_LIGHTS,
+    BSCENE_NUM_ARRAYS
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;		/* sizeof(BSceneHeader) */
+    uint64_t sourceHash;		/* hash of the text scene, 0 if none */
+    uint64_t sourceSize;		/* size of the text scene in bytes */
+    uint64_t sourceMtime;		/* its modification time in ns */
+    uint32_t numTriangles;
+    uint32_t numSpheres;
+    uint32_t numLights;
+    uint32_t reserved;
+    double ambient[3];
+    uint64_t offset[BSCENE_NUM_ARRAYS];	/* byte offset of every array */
+} BSceneHeader;
+
+typedef struct {
+    double position[3];
+    double radius;
+    double color_diffuse[3];
+    double color_specular[3];
+    double shininess;
+} BSceneSphere;
+
+typedef struct {
+    double position[3];
+    double color[3];
+} BSceneLight;
+
+#endif
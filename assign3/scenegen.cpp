@@ -0,0 +1,452 @@
+/*
+CSCI 420
+Assignment 3 Raytracer
+
+Procedural stress scenes for scaling tests, written as .scene text or as a
+binary scene (bscene.h) when the output name ends in .bscene.
+*/
+
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+#include "bscene.h"
+
+//what to generate, set from the command line
+long num_triangles=0;
+long num_spheres=0;
+int num_lights=1;
+uint64_t seed=1;
+
+//uniform: objects anywhere in the box, clustered: gaussian blobs around a
+//few centers, occluder: uniform plus one large quad between the objects and
+//the lights
+#define DIST_UNIFORM 0
+#define DIST_CLUSTERED 1
+#define DIST_OCCLUDER 2
+int distribution=DIST_UNIFORM;
+
+//objects fill this box in front of the default camera (origin, looking
+//down -z with a 60 degree field of view)
+double boxMin[3] = {-12.0,-9.0,-45.0};
+double boxMax[3] = {12.0,9.0,-15.0};
+
+//RANDOM NUMBERS
+//Counter based: every object draws from its own stream seeded with
+//(seed, kind, index), so any array of the binary format can be written in
+//its own pass and the output does not depend on the platform's rand().
+#define STREAM_TRIANGLE 1
+#define STREAM_SPHERE 2
+#define STREAM_LIGHT 3
+#define STREAM_CLUSTER 4
+
+struct Rng
+{
+  uint64_t state;
+};
+
+uint64_t splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+Rng rngFor(int stream, uint64_t index)
+{
+  Rng r;
+  r.state = seed*0x9e3779b97f4a7c15ULL ^ ((uint64_t)stream << 56) ^ index;
+  splitmix64(&r.state);
+  return r;
+}
+
+//uniform in [0,1)
+double uniform(Rng *r)
+{
+  return (splitmix64(&r->state) >> 11) * (1.0/9007199254740992.0);
+}
+
+double uniform(Rng *r, double lo, double hi)
+{
+  return lo + (hi-lo)*uniform(r);
+}
+
+//standard normal, Box-Muller
+double gaussian(Rng *r)
+{
+  double u1 = uniform(r), u2 = uniform(r);
+  if(u1 < 1e-300)
+    u1 = 1e-300;
+  return sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+//SCENE LAYOUT
+std::vector<double> clusterCenters;	//3 per cluster
+double clusterSigma;
+double objectSize;
+
+void setupLayout()
+{
+  //keep the covered fraction of the box about the same at any count
+  long total = num_triangles+num_spheres;
+  double volume = 1.0;
+  for(int a=0;a<3;a++)
+    volume *= boxMax[a]-boxMin[a];
+  objectSize = 0.6*cbrt(volume/(total > 0 ? total : 1));
+
+  if(distribution == DIST_CLUSTERED)
+    {
+      //roughly one cluster per thousand objects, at least 4
+      long clusters = total/1000;
+      if(clusters < 4)
+	clusters = 4;
+      if(clusters > 4096)
+	clusters = 4096;
+      clusterCenters.resize(3*clusters);
+      for(long c=0;c<clusters;c++)
+	{
+	  Rng r = rngFor(STREAM_CLUSTER,c);
+	  for(int a=0;a<3;a++)
+	    clusterCenters[3*c+a] = uniform(&r,boxMin[a],boxMax[a]);
+	}
+      clusterSigma = 0.25*(boxMax[0]-boxMin[0])/cbrt((double)clusters);
+      //objects crowd into the clusters, shrink them accordingly
+      objectSize *= 0.5;
+    }
+}
+
+void objectCenter(Rng *r, double center[3])
+{
+  if(distribution == DIST_CLUSTERED)
+    {
+      long c = (long)(uniform(r)*(clusterCenters.size()/3));
+      for(int a=0;a<3;a++)
+	center[a] = clusterCenters[3*c+a] + clusterSigma*gaussian(r);
+      return;
+    }
+  for(int a=0;a<3;a++)
+    center[a] = uniform(r,boxMin[a],boxMax[a]);
+}
+
+struct GenVertex
+{
+  double position[3];
+  double normal[3];
+  double color_diffuse[3];
+  double color_specular[3];
+  double shininess;
+};
+
+struct GenSphere
+{
+  double position[3];
+  double radius;
+  double color_diffuse[3];
+  double color_specular[3];
+  double shininess;
+};
+
+struct GenLight
+{
+  double position[3];
+  double color[3];
+};
+
+//the occluder is the last two triangles, a quad just above the box
+long occluderTriangles()
+{
+  return distribution == DIST_OCCLUDER ? 2 : 0;
+}
+
+void occluderTriangle(long k, GenVertex v[3])
+{
+  double y = boxMax[1]+2.0;
+  double x0 = boxMin[0]-5.0, x1 = boxMax[0]+5.0;
+  double z0 = boxMin[2]-5.0, z1 = boxMax[2]+5.0;
+  double quad[4][3] = {{x0,y,z0},{x1,y,z0},{x1,y,z1},{x0,y,z1}};
+  int corners[2][3] = {{0,2,1},{0,3,2}};
+  for(int j=0;j<3;j++)
+    {
+      memcpy(v[j].position,quad[corners[k][j]],sizeof(v[j].position));
+      v[j].normal[0] = 0.0;
+      v[j].normal[1] = -1.0;
+      v[j].normal[2] = 0.0;
+      for(int a=0;a<3;a++)
+	{
+	  v[j].color_diffuse[a] = 0.5;
+	  v[j].color_specular[a] = 0.1;
+	}
+      v[j].shininess = 5.0;
+    }
+}
+
+void makeTriangle(long i, GenVertex v[3])
+{
+  long random = num_triangles-occluderTriangles();
+  if(i >= random)
+    {
+      occluderTriangle(i-random,v);
+      return;
+    }
+  Rng r = rngFor(STREAM_TRIANGLE,i);
+  double center[3];
+  objectCenter(&r,center);
+  for(int j=0;j<3;j++)
+    for(int a=0;a<3;a++)
+      v[j].position[a] = center[a] + objectSize*uniform(&r,-1.0,1.0);
+
+  //flat shaded, facing the camera side
+  double e1[3], e2[3], n[3];
+  for(int a=0;a<3;a++)
+    {
+      e1[a] = v[1].position[a]-v[0].position[a];
+      e2[a] = v[2].position[a]-v[0].position[a];
+    }
+  n[0] = e1[1]*e2[2]-e1[2]*e2[1];
+  n[1] = e1[2]*e2[0]-e1[0]*e2[2];
+  n[2] = e1[0]*e2[1]-e1[1]*e2[0];
+  double len = sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+  if(len == 0)
+    {
+      n[2] = 1.0;
+      len = 1.0;
+    }
+  if(n[2] < 0)
+    len = -len;
+
+  double diffuse[3] = {uniform(&r),uniform(&r),uniform(&r)};
+  double shininess = uniform(&r,5.0,50.0);
+  for(int j=0;j<3;j++)
+    for(int a=0;a<3;a++)
+      {
+	v[j].normal[a] = n[a]/len;
+	v[j].color_diffuse[a] = diffuse[a];
+	v[j].color_specular[a] = 0.3;
+	v[j].shininess = shininess;
+      }
+}
+
+void makeSphere(long i, GenSphere *s)
+{
+  Rng r = rngFor(STREAM_SPHERE,i);
+  objectCenter(&r,s->position);
+  s->radius = objectSize*uniform(&r,0.25,0.75);
+  for(int a=0;a<3;a++)
+    {
+      s->color_diffuse[a] = uniform(&r);
+      s->color_specular[a] = 0.5;
+    }
+  s->shininess = uniform(&r,5.0,50.0);
+}
+
+//lights sit above and in front of the box, sharing a total intensity of 1
+//(above the occluder when there is one)
+void makeLight(int i, GenLight *l)
+{
+  Rng r = rngFor(STREAM_LIGHT,i);
+  l->position[0] = uniform(&r,boxMin[0],boxMax[0]);
+  l->position[1] = boxMax[1] + uniform(&r,5.0,15.0);
+  l->position[2] = uniform(&r,boxMax[2],0.0);
+  for(int a=0;a<3;a++)
+    l->color[a] = 1.0/num_lights;
+}
+
+//WRITERS
+//text is printed with full precision so it loads to the same scene as the
+//binary file, make check-parser converts both and compares them
+void writeText(FILE *out)
+{
+  fprintf(out,"%ld\n",num_triangles+num_spheres+num_lights);
+  fprintf(out,"amb: 0.1 0.1 0.1\n");
+  for(long i=0;i<num_triangles;i++)
+    {
+      GenVertex v[3];
+      makeTriangle(i,v);
+      fprintf(out,"triangle\n");
+      for(int j=0;j<3;j++)
+	{
+	  fprintf(out,"pos: %.17g %.17g %.17g\n",v[j].position[0],v[j].position[1],v[j].position[2]);
+	  fprintf(out,"nor: %.17g %.17g %.17g\n",v[j].normal[0],v[j].normal[1],v[j].normal[2]);
+	  fprintf(out,"dif: %.17g %.17g %.17g\n",v[j].color_diffuse[0],v[j].color_diffuse[1],v[j].color_diffuse[2]);
+	  fprintf(out,"spe: %.17g %.17g %.17g\n",v[j].color_specular[0],v[j].color_specular[1],v[j].color_specular[2]);
+	  fprintf(out,"shi: %.17g\n",v[j].shininess);
+	}
+    }
+  for(long i=0;i<num_spheres;i++)
+    {
+      GenSphere s;
+      makeSphere(i,&s);
+      fprintf(out,"sphere\n");
+      fprintf(out,"pos: %.17g %.17g %.17g\n",s.position[0],s.position[1],s.position[2]);
+      fprintf(out,"rad: %.17g\n",s.radius);
+      fprintf(out,"dif: %.17g %.17g %.17g\n",s.color_diffuse[0],s.color_diffuse[1],s.color_diffuse[2]);
+      fprintf(out,"spe: %.17g %.17g %.17g\n",s.color_specular[0],s.color_specular[1],s.color_specular[2]);
+      fprintf(out,"shi: %.17g\n",s.shininess);
+    }
+  for(int i=0;i<num_lights;i++)
+    {
+      GenLight l;
+      makeLight(i,&l);
+      fprintf(out,"light\n");
+      fprintf(out,"pos: %.17g %.17g %.17g\n",l.position[0],l.position[1],l.position[2]);
+      fprintf(out,"col: %.17g %.17g %.17g\n",l.color[0],l.color[1],l.color[2]);
+    }
+}
+
+void padTo(FILE *out, uint64_t *written, uint64_t offset)
+{
+  static const char zeros[BSCENE_ALIGN] = {0};
+  fwrite(zeros,1,offset-*written,out);
+  *written = offset;
+}
+
+//The binary arrays are written one after the other, every triangle array
+//regenerates the triangles so nothing scales with the scene in memory
+void writeBinary(FILE *out)
+{
+  BSceneHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,BSCENE_MAGIC,8);
+  header.version = BSCENE_VERSION;
+  header.headerSize = sizeof(BSceneHeader);
+  header.numTriangles = num_triangles;
+  header.numSpheres = num_spheres;
+  header.numLights = num_lights;
+  header.ambient[0] = header.ambient[1] = header.ambient[2] = 0.1;
+
+  uint64_t nt = num_triangles;
+  uint64_t bytes[BSCENE_NUM_ARRAYS] = {nt*9*sizeof(double),nt*9*sizeof(double),nt*9*sizeof(double),
+                                       nt*9*sizeof(double),nt*3*sizeof(double),
+                                       num_spheres*sizeof(BSceneSphere),num_lights*sizeof(BSceneLight)};
+  uint64_t offset = sizeof(header);
+  for(int k=0;k<BSCENE_NUM_ARRAYS;k++)
+    {
+      offset = (offset+BSCENE_ALIGN-1)/BSCENE_ALIGN*BSCENE_ALIGN;
+      header.offset[k] = offset;
+      offset += bytes[k];
+    }
+
+  uint64_t written = sizeof(header);
+  fwrite(&header,sizeof(header),1,out);
+  for(int k=BSCENE_TRI_POSITION;k<=BSCENE_TRI_SHININESS;k++)
+    {
+      padTo(out,&written,header.offset[k]);
+      for(long i=0;i<num_triangles;i++)
+	{
+	  GenVertex v[3];
+	  makeTriangle(i,v);
+	  for(int j=0;j<3;j++)
+	    {
+	      const double *p;
+	      int n = 3;
+	      switch(k)
+		{
+		case BSCENE_TRI_POSITION: p = v[j].position; break;
+		case BSCENE_TRI_NORMAL: p = v[j].normal; break;
+		case BSCENE_TRI_DIFFUSE: p = v[j].color_diffuse; break;
+		case BSCENE_TRI_SPECULAR: p = v[j].color_specular; break;
+		default: p = &v[j].shininess; n = 1; break;
+		}
+	      fwrite(p,sizeof(double),n,out);
+	    }
+	}
+      written += bytes[k];
+    }
+
+  padTo(out,&written,header.offset[BSCENE_SPHERES]);
+  for(long i=0;i<num_spheres;i++)
+    {
+      GenSphere g;
+      makeSphere(i,&g);
+      BSceneSphere s;
+      memcpy(s.position,g.position,sizeof(s.position));
+      s.radius = g.radius;
+      memcpy(s.color_diffuse,g.color_diffuse,sizeof(s.color_diffuse));
+      memcpy(s.color_specular,g.color_specular,sizeof(s.color_specular));
+      s.shininess = g.shininess;
+      fwrite(&s,sizeof(s),1,out);
+    }
+  written += bytes[BSCENE_SPHERES];
+
+  padTo(out,&written,header.offset[BSCENE_LIGHTS]);
+  for(int i=0;i<num_lights;i++)
+    {
+      GenLight g;
+      makeLight(i,&g);
+      BSceneLight l;
+      memcpy(l.position,g.position,sizeof(l.position));
+      memcpy(l.color,g.color,sizeof(l.color));
+      fwrite(&l,sizeof(l),1,out);
+    }
+}
+
+int main(int argc, char **argv)
+{
+  char *output=NULL;
+  bool usage=false;
+  for(int i=1;i<argc;i++)
+    {
+      if(strcmp(argv[i],"--triangles") == 0 && i+1 < argc)
+	num_triangles = atol(argv[++i]);
+      else if(strcmp(argv[i],"--spheres") == 0 && i+1 < argc)
+	num_spheres = atol(argv[++i]);
+      else if(strcmp(argv[i],"--lights") == 0 && i+1 < argc)
+	num_lights = atoi(argv[++i]);
+      else if(strcmp(argv[i],"--seed") == 0 && i+1 < argc)
+	seed = strtoull(argv[++i],NULL,10);
+      else if(strcmp(argv[i],"--dist") == 0 && i+1 < argc)
+	{
+	  i++;
+	  if(strcmp(argv[i],"uniform") == 0)
+	    distribution = DIST_UNIFORM;
+	  else if(strcmp(argv[i],"clustered") == 0)
+	    distribution = DIST_CLUSTERED;
+	  else if(strcmp(argv[i],"occluder") == 0)
+	    distribution = DIST_OCCLUDER;
+	  else
+	    usage = true;
+	}
+      else if(strncmp(argv[i],"--",2) == 0 || output)
+	usage = true;
+      else
+	output = argv[i];
+    }
+  //the occluder quad takes two of the triangles
+  if(distribution == DIST_OCCLUDER && num_triangles < 2)
+    num_triangles = 2;
+  //the binary format and the renderer count in 32 bits
+  if(usage || !output || num_triangles < 0 || num_spheres < 0 || num_lights < 1 ||
+     num_triangles > 0x7fffffffL || num_spheres > 0x7fffffffL)
+    {
+      printf("usage: %s [--triangles N] [--spheres N] [--lights N] [--dist uniform|clustered|occluder]\n       [--seed S] <out.scene|out.bscene>\n",argv[0]);
+      exit(0);
+    }
+
+  setupLayout();
+  size_t len = strlen(output);
+  bool binary = len > 7 && strcmp(output+len-7,".bscene") == 0;
+  FILE *out = fopen(output,binary ? "wb" : "w");
+  if(!out)
+    {
+      printf("Could not write %s\n",output);
+      exit(1);
+    }
+  if(binary)
+    writeBinary(out);
+  else
+    writeText(out);
+  bool failed = ferror(out) != 0;
+  failed = (fclose(out) != 0) || failed;
+  if(failed)
+    {
+      printf("Could not write %s\n",output);
+      remove(output);
+      exit(1);
+    }
+  printf("Wrote %ld triangles, %ld spheres, %d lights to %s\n",num_triangles,num_spheres,num_lights,output);
+  return 0;
+}